@@ -1,9 +1,31 @@
 #pragma once
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <barrier>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <i3d/image3d.h>
+#include <i3d/neighbours.h>
+#include <i3d/se.h>
+#include <i3d/toolbox.h>
 #include <i3d/vector3d.h>
+#include <latch>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
 #include <tuple>
 #include <type_traits>
+#include <vector>
+#include "_fast_morphology_simd.hpp"
 
 namespace i3d {
 namespace fast_morphology {
@@ -48,6 +70,978 @@ constexpr std::array<T, N + M> concat_arrays(const std::array<T, N>& lhs,
 		out[i + N] = rhs[i];
 	return out;
 }
+
+constexpr std::tuple<int, int, int> to_3d(const std::tuple<int, int, int>& c) {
+	return c;
+}
+constexpr std::tuple<int, int, int> to_3d(const std::tuple<int, int>& c) {
+	auto [x, y] = c;
+	return {x, y, 0};
+}
+constexpr std::tuple<int, int, int> to_3d(int x) { return {x, 0, 0}; }
+
+template <typename T, std::size_t N>
+constexpr std::array<std::tuple<int, int, int>, N>
+to_3d(const std::array<T, N>& arr) {
+	std::array<std::tuple<int, int, int>, N> out;
+	for (std::size_t i = 0; i < N; ++i)
+		out[i] = to_3d(arr[i]);
+	return out;
+}
+
+struct max_fun {
+	template <typename T>
+	T operator()(T a, T b) const {
+		return std::max(a, b);
+	}
+};
+
+struct min_fun {
+	template <typename T>
+	T operator()(T a, T b) const {
+		return std::min(a, b);
+	}
+};
+
+/// Neighbour coordinate differences paired with signed offsets into the
+/// linear voxel buffer of an image of the given size.
+template <std::size_t N>
+struct linear_neighbourhood {
+	std::array<std::tuple<int, int, int>, N> coords;
+	std::array<std::ptrdiff_t, N> offsets;
+	Vector3d<int> size;
+	// farthest neighbour along every axis (only the axes reached need bound
+	// checks)
+	Vector3d<int> reach;
+	// offsets of the neighbours outside the voxel's own row
+	std::array<std::ptrdiff_t, N> cross_offsets;
+	std::size_t cross_count = 0;
+	// dx of the only in-row neighbour, 0 if there is none or more of them
+	int row_dx = 0;
+
+	linear_neighbourhood(const std::array<std::tuple<int, int, int>, N>& c,
+	                     Vector3d<int> size_)
+	    : coords(c), size(size_), reach(0, 0, 0) {
+		int in_row = 0;
+		for (std::size_t i = 0; i < N; ++i) {
+			auto [dx, dy, dz] = coords[i];
+			offsets[i] = dx + std::ptrdiff_t(size.x) *
+			                      (dy + std::ptrdiff_t(size.y) * dz);
+			reach.x = std::max(reach.x, std::abs(dx));
+			reach.y = std::max(reach.y, std::abs(dy));
+			reach.z = std::max(reach.z, std::abs(dz));
+			if (dy != 0 || dz != 0)
+				cross_offsets[cross_count++] = offsets[i];
+			else if (dx != 0) {
+				++in_row;
+				row_dx = dx;
+			}
+		}
+		if (in_row != 1)
+			row_dx = 0;
+	}
+
+	bool contains(int x, int y, int z) const {
+		return 0 <= x && x < size.x && 0 <= y && y < size.y && 0 <= z &&
+		       z < size.z;
+	}
+
+	// every neighbour of voxels (x, y, z) with reach.x <= x < size.x - reach.x
+	// lies inside the image
+	bool row_interior(int y, int z) const {
+		return reach.y <= y && y < size.y - reach.y && reach.z <= z &&
+		       z < size.z - reach.z;
+	}
+
+	// every neighbour of (x, y, z) lies inside the image
+	bool interior(int x, int y, int z) const {
+		return reach.x <= x && x < size.x - reach.x && row_interior(y, z);
+	}
+
+	// calls fun(idx + offset) for every neighbour of voxel idx = (x, y, z)
+	// that lies inside the image
+	template <typename fun_t>
+	void for_each(int x, int y, int z, std::size_t idx, fun_t fun) const {
+		if (interior(x, y, z)) {
+			unroll<N>([&](std::size_t i) { fun(idx + offsets[i]); });
+			return;
+		}
+		for (std::size_t i = 0; i < N; ++i) {
+			auto [dx, dy, dz] = coords[i];
+			if (contains(x + dx, y + dy, z + dz))
+				fun(idx + offsets[i]);
+		}
+	}
+};
+
+struct no_visit {
+	void operator()(int, int, int, std::size_t) const {}
+};
+
+// Updates voxels x_begin <= x < x_end of the row (y, z) in raster (forward)
+// or anti-raster order from the neighbours in neigh and returns the number of
+// changed voxels. Neighbours outside the segment are read, never written.
+// visit is called with (x, y, z, idx) of every voxel right after its update.
+template <bool forward,
+          typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          typename visit_f = no_visit>
+std::size_t sweep_segment(img_t* data,
+                          const img_t* mask_data,
+                          neigh_f neighbour_fun,
+                          mask_f mask_fun,
+                          const linear_neighbourhood<N>& neigh,
+                          int y,
+                          int z,
+                          int x_begin,
+                          int x_end,
+                          visit_f visit = {}) {
+	const int size_x = neigh.size.x;
+	const std::size_t row = (std::size_t(z) * neigh.size.y + y) * size_x;
+	std::size_t changed = 0;
+
+	auto process_bound = [&](int x) {
+		std::size_t idx = row + x;
+		img_t center = data[idx];
+		img_t val = center;
+		neigh.for_each(x, y, z, idx, [&](std::size_t n) {
+			val = neighbour_fun(data[n], val);
+		});
+		img_t new_val = mask_fun(val, mask_data[idx]);
+		changed += (center != new_val);
+		data[idx] = new_val;
+		visit(x, y, z, idx);
+	};
+
+	auto process_inner = [&](int x) {
+		img_t* p = data + row + x;
+		img_t center = *p;
+		img_t val = center;
+		unroll<N>([&](std::size_t i) {
+			val = neighbour_fun(p[neigh.offsets[i]], val);
+		});
+		img_t new_val = mask_fun(val, mask_data[row + x]);
+		changed += (center != new_val);
+		*p = new_val;
+		visit(x, y, z, row + x);
+	};
+
+	// voxels inner_begin <= x < inner_end have all neighbours inside
+	int inner_begin = std::max(x_begin, neigh.reach.x);
+	int inner_end = std::min(x_end, size_x - neigh.reach.x);
+	if (!neigh.row_interior(y, z) || inner_begin >= inner_end) {
+		if constexpr (forward)
+			for (int x = x_begin; x < x_end; ++x)
+				process_bound(x);
+		else
+			for (int x = x_end - 1; x >= x_begin; --x)
+				process_bound(x);
+		return changed;
+	}
+
+	auto process_inner_run = [&] {
+#ifdef I3D_FAST_MORPHOLOGY_SIMD
+		// max/min over the other rows vectorised, in-row dependency by a scan
+		constexpr bool dilation = std::is_same_v<neigh_f, max_fun> &&
+		                          std::is_same_v<mask_f, min_fun>;
+		constexpr bool erosion = std::is_same_v<neigh_f, min_fun> &&
+		                         std::is_same_v<mask_f, max_fun>;
+		if constexpr (simd::has_row_kernel<img_t> &&
+		              std::is_same_v<visit_f, no_visit> &&
+		              (dilation || erosion)) {
+			// the neighbours but the in-row one lie in other rows
+			if (neigh.row_dx == (forward ? -1 : 1) &&
+			    neigh.cross_count == N - 1) {
+				int carry = forward ? inner_begin - 1 : inner_end;
+				changed += simd::row<forward, dilation, N - 1>(
+				    data + row + inner_begin, mask_data + row + inner_begin,
+				    neigh.cross_offsets.data(),
+				    std::size_t(inner_end - inner_begin), data[row + carry]);
+				return;
+			}
+		}
+#endif
+		if constexpr (forward)
+			for (int x = inner_begin; x < inner_end; ++x)
+				process_inner(x);
+		else
+			for (int x = inner_end - 1; x >= inner_begin; --x)
+				process_inner(x);
+	};
+
+	if constexpr (forward) {
+		for (int x = x_begin; x < inner_begin; ++x)
+			process_bound(x);
+		process_inner_run();
+		for (int x = inner_end; x < x_end; ++x)
+			process_bound(x);
+	} else {
+		for (int x = x_end - 1; x >= inner_end; --x)
+			process_bound(x);
+		process_inner_run();
+		for (int x = inner_begin - 1; x >= x_begin; --x)
+			process_bound(x);
+	}
+	return changed;
+}
+
+template <bool forward,
+          typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          typename visit_f = no_visit>
+std::size_t sweep_row(img_t* data,
+                      const img_t* mask_data,
+                      neigh_f neighbour_fun,
+                      mask_f mask_fun,
+                      const linear_neighbourhood<N>& neigh,
+                      int y,
+                      int z,
+                      visit_f visit = {}) {
+	return sweep_segment<forward>(data, mask_data, neighbour_fun, mask_fun,
+	                              neigh, y, z, 0, neigh.size.x, visit);
+}
+
+// One raster (forward) or anti-raster pass over the box begin <= (x, y, z) <
+// end, returns the number of changed voxels.
+template <bool forward,
+          typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          typename visit_f = no_visit>
+std::size_t sweep_box(img_t* data,
+                      const img_t* mask_data,
+                      neigh_f neighbour_fun,
+                      mask_f mask_fun,
+                      const linear_neighbourhood<N>& neigh,
+                      const Vector3d<int>& begin,
+                      const Vector3d<int>& end,
+                      visit_f visit = {}) {
+	std::size_t changed = 0;
+	if constexpr (forward) {
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+				changed += sweep_segment<true>(data, mask_data, neighbour_fun,
+				                               mask_fun, neigh, y, z, begin.x,
+				                               end.x, visit);
+	} else {
+		for (int z = end.z - 1; z >= begin.z; --z)
+			for (int y = end.y - 1; y >= begin.y; --y)
+				changed += sweep_segment<false>(data, mask_data, neighbour_fun,
+				                                mask_fun, neigh, y, z, begin.x,
+				                                end.x, visit);
+	}
+	return changed;
+}
+
+// One raster (forward) or anti-raster pass over the whole image, returns the
+// number of changed voxels.
+template <bool forward,
+          typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          typename visit_f = no_visit>
+std::size_t sweep(img_t* data,
+                  const img_t* mask_data,
+                  neigh_f neighbour_fun,
+                  mask_f mask_fun,
+                  const linear_neighbourhood<N>& neigh,
+                  visit_f visit = {}) {
+	return sweep_box<forward>(data, mask_data, neighbour_fun, mask_fun, neigh,
+	                          Vector3d<int>(0, 0, 0), neigh.size, visit);
+}
+
+// neutral element of the max / min functor fun
+template <typename img_t, typename fun_t>
+img_t neutral_element(fun_t fun) {
+	return fun(lowest<img_t>(), highest<img_t>()) == highest<img_t>()
+	           ? lowest<img_t>()
+	           : highest<img_t>();
+}
+
+// Marker extrema of blocks of edge^3 voxels of the box begin <= (x, y, z) <
+// end: the best marker value (max for dilation) and the worst one among the
+// voxels below their mask. No voxel of a block can change while no value of
+// the block or of the blocks its neighbourhood reaches beats the latter.
+// Summaries of the blocks changed by a pass are stale, the blocks and their
+// neighbours are swept by the next pass, and recomputed once a pass leaves
+// them unchanged, so the upkeep is proportional to the changed blocks.
+template <typename img_t>
+struct block_summary {
+	static constexpr int edge = 8;
+
+	img_t* data;
+	const img_t* mask_data;
+	Vector3d<int> size, begin, end, blocks;
+	// blocks reached by the neighbourhood along every axis
+	Vector3d<int> around;
+	std::vector<img_t> best, worst_open;
+	std::vector<bool> stale, changed, skippable, queued;
+	// blocks changed by the previous and by the current pass
+	std::vector<std::size_t> stale_list, changed_list, update_list;
+
+	// clamps the marker by the mask and builds the summary in one pass
+	template <typename neigh_f, typename mask_f>
+	block_summary(img_t* data_,
+	              const img_t* mask_data_,
+	              Vector3d<int> size_,
+	              Vector3d<int> begin_,
+	              Vector3d<int> end_,
+	              Vector3d<int> reach,
+	              neigh_f neighbour_fun,
+	              mask_f mask_fun)
+	    : data(data_), mask_data(mask_data_), size(size_), begin(begin_),
+	      end(end_), blocks((end.x - begin.x + edge - 1) / edge,
+	                        (end.y - begin.y + edge - 1) / edge,
+	                        (end.z - begin.z + edge - 1) / edge),
+	      around((reach.x + edge - 1) / edge, (reach.y + edge - 1) / edge,
+	             (reach.z + edge - 1) / edge) {
+		const std::size_t count = std::size_t(blocks.x) * blocks.y * blocks.z;
+		best.assign(count, neutral_element<img_t>(neighbour_fun));
+		worst_open.assign(count, neutral_element<img_t>(mask_fun));
+		stale.assign(count, false);
+		changed.assign(count, false);
+		skippable.assign(count, false);
+		queued.assign(count, false);
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y) {
+				std::size_t row = (std::size_t(z) * size.y + y) * size.x;
+				for (int x = begin.x; x < end.x; ++x)
+					data[row + x] = mask_fun(data[row + x], mask_data[row + x]);
+				std::size_t first =
+				    index(0, (y - begin.y) / edge, (z - begin.z) / edge);
+				for (int bx = 0; bx < blocks.x; ++bx)
+					accumulate(first + bx, row, begin.x + bx * edge,
+					           std::min(begin.x + (bx + 1) * edge, end.x),
+					           neighbour_fun, mask_fun);
+			}
+		for (std::size_t b = 0; b < count; ++b)
+			update_skippable(b, neighbour_fun);
+	}
+
+	std::size_t index(int bx, int by, int bz) const {
+		return (std::size_t(bz) * blocks.y + by) * blocks.x + bx;
+	}
+
+	// adds the voxels x_begin <= x < x_end of the row starting at row to the
+	// summary of block b
+	template <typename neigh_f, typename mask_f>
+	void accumulate(std::size_t b,
+	                std::size_t row,
+	                int x_begin,
+	                int x_end,
+	                neigh_f neighbour_fun,
+	                mask_f mask_fun) {
+		const img_t open_neutral = neutral_element<img_t>(mask_fun);
+		img_t block_best = best[b], block_open = worst_open[b];
+		for (int x = x_begin; x < x_end; ++x) {
+			img_t val = data[row + x];
+			// branch-free select, saturated voxels are scattered at random
+			const img_t choice[2] = {val, open_neutral};
+			block_best = neighbour_fun(block_best, val);
+			block_open =
+			    mask_fun(block_open, choice[val == mask_data[row + x]]);
+		}
+		best[b] = block_best;
+		worst_open[b] = block_open;
+	}
+
+	template <typename neigh_f, typename mask_f>
+	void recompute(std::size_t b, neigh_f neighbour_fun, mask_f mask_fun) {
+		int bx = int(b % blocks.x), by = int(b / blocks.x % blocks.y),
+		    bz = int(b / blocks.x / blocks.y);
+		best[b] = neutral_element<img_t>(neighbour_fun);
+		worst_open[b] = neutral_element<img_t>(mask_fun);
+		int x_begin = begin.x + bx * edge;
+		int x_end = std::min(x_begin + edge, end.x);
+		for (int z = begin.z + bz * edge;
+		     z < std::min(begin.z + (bz + 1) * edge, end.z); ++z)
+			for (int y = begin.y + by * edge;
+			     y < std::min(begin.y + (by + 1) * edge, end.y); ++y)
+				accumulate(b, (std::size_t(z) * size.y + y) * size.x, x_begin,
+				           x_end, neighbour_fun, mask_fun);
+	}
+
+	// calls fun(index) for the block (bx, by, bz) and the blocks around it
+	template <typename fun_t>
+	void for_each_around(std::size_t b, fun_t fun) const {
+		int bx = int(b % blocks.x), by = int(b / blocks.x % blocks.y),
+		    bz = int(b / blocks.x / blocks.y);
+		for (int z = std::max(bz - around.z, 0);
+		     z <= std::min(bz + around.z, blocks.z - 1); ++z)
+			for (int y = std::max(by - around.y, 0);
+			     y <= std::min(by + around.y, blocks.y - 1); ++y)
+				for (int x = std::max(bx - around.x, 0);
+				     x <= std::min(bx + around.x, blocks.x - 1); ++x)
+					fun(index(x, y, z));
+	}
+
+	template <typename neigh_f>
+	void update_skippable(std::size_t b, neigh_f neighbour_fun) {
+		img_t around = neutral_element<img_t>(neighbour_fun);
+		bool known = true;
+		for_each_around(b, [&](std::size_t n) {
+			around = neighbour_fun(around, img_t(best[n]));
+			known = known && !stale[n];
+		});
+		const img_t open = worst_open[b];
+		skippable[b] = known && neighbour_fun(around, open) == open;
+	}
+
+	// Called before each pass: recomputes the blocks the previous pass left
+	// unchanged, marks the ones it changed stale and decides which blocks the
+	// pass skips.
+	template <typename neigh_f, typename mask_f>
+	void refresh(neigh_f neighbour_fun, mask_f mask_fun) {
+		auto queue_around = [&](std::size_t b) {
+			for_each_around(b, [&](std::size_t n) {
+				if (!queued[n]) {
+					queued[n] = true;
+					update_list.push_back(n);
+				}
+			});
+		};
+		for (std::size_t b : stale_list)
+			if (!changed[b]) {
+				stale[b] = false;
+				recompute(b, neighbour_fun, mask_fun);
+				queue_around(b);
+			}
+		for (std::size_t b : changed_list) {
+			changed[b] = false;
+			if (!stale[b]) {
+				stale[b] = true;
+				queue_around(b);
+			}
+		}
+		for (std::size_t b : update_list) {
+			queued[b] = false;
+			update_skippable(b, neighbour_fun);
+		}
+		update_list.clear();
+		stale_list.swap(changed_list);
+		changed_list.clear();
+	}
+
+	// blocks bx_begin <= bx < bx_end of the block row (by, bz) changed; the
+	// blocks around them can change later in the same pass
+	void mark_changed(int bx_begin, int bx_end, int by, int bz) {
+		std::size_t first = index(0, by, bz);
+		for (int bx = bx_begin; bx < bx_end; ++bx)
+			if (!changed[first + bx]) {
+				changed[first + bx] = true;
+				changed_list.push_back(first + bx);
+				for_each_around(first + bx,
+				                [&](std::size_t n) { skippable[n] = false; });
+			}
+	}
+};
+
+typedef std::chrono::steady_clock stats_clock;
+
+inline double seconds_since(stats_clock::time_point start) {
+	return std::chrono::duration<double>(stats_clock::now() - start).count();
+}
+
+// Limits of options::max_passes, max_seconds and cancel, counted from
+// construction. Once stopped, the engines return with the marker partly
+// updated.
+struct budget {
+	// calls of interrupted() per reading of the clock
+	static constexpr unsigned poll_every = 64;
+
+	std::size_t max_passes;
+	double max_seconds;
+	const std::atomic<bool>* cancel;
+	stats_clock::time_point start = stats_clock::now();
+	std::size_t passes = 0;
+	unsigned polls = 0;
+	bool stopped = false;
+
+	explicit budget(const options& options_)
+	    : max_passes(options_.max_passes), max_seconds(options_.max_seconds),
+	      cancel(options_.cancel) {}
+
+	static bool limits(const options& options_) {
+		return options_.max_passes != 0 || options_.max_seconds > 0 ||
+		       options_.cancel != nullptr;
+	}
+
+	bool check(bool read_clock) {
+		if (!stopped)
+			stopped = (cancel != nullptr &&
+			           cancel->load(std::memory_order_relaxed)) ||
+			          (max_seconds > 0 && read_clock &&
+			           seconds_since(start) > max_seconds);
+		return stopped;
+	}
+
+	// checked between rows and queued voxels
+	bool interrupted() { return check(++polls % poll_every == 0); }
+
+	// false once no further raster pass may start
+	bool next_pass() {
+		if (max_passes != 0 && passes == max_passes)
+			stopped = true;
+		++passes;
+		return !check(true);
+	}
+};
+
+inline options without_limits(options options_) {
+	options_.max_passes = 0;
+	options_.max_seconds = 0;
+	options_.cancel = nullptr;
+	return options_;
+}
+
+// Rows (y, z) changed by the previous and the current raster pass, with a
+// summary per slice. A row has to be swept only if a row it reads, itself
+// included, changed since its last sweep in the same direction, i.e. in the
+// previous or the current pass. All rows count as changed before the first
+// two passes.
+struct dirty_rows {
+	Vector3d<int> size;
+	// (dy, dz) of the rows a row reads, (0, 0) included
+	std::vector<std::pair<int, int>> deps;
+	// largest |dz| among them
+	int reach_z = 0;
+	std::vector<bool> previous, current;
+	std::vector<bool> previous_slices, current_slices;
+
+	template <std::size_t N>
+	dirty_rows(const std::array<std::tuple<int, int, int>, N>& neigh,
+	           Vector3d<int> size_)
+	    : size(size_), deps{{0, 0}},
+	      previous(std::size_t(size_.y) * size_.z, true),
+	      current(previous.size(), true), previous_slices(size_.z, true),
+	      current_slices(size_.z, true) {
+		for (auto [dx, dy, dz] : neigh) {
+			if (std::find(deps.begin(), deps.end(), std::pair{dy, dz}) ==
+			    deps.end())
+				deps.emplace_back(dy, dz);
+			reach_z = std::max(reach_z, std::abs(dz));
+		}
+	}
+
+	bool changed(std::size_t row) const {
+		return previous[row] || current[row];
+	}
+
+	bool slice_dirty(int z) const {
+		for (int dz = -reach_z; dz <= reach_z; ++dz)
+			if (0 <= z + dz && z + dz < size.z &&
+			    (previous_slices[z + dz] || current_slices[z + dz]))
+				return true;
+		return false;
+	}
+
+	bool row_dirty(int y, int z) const {
+		for (auto [dy, dz] : deps)
+			if (0 <= y + dy && y + dy < size.y && 0 <= z + dz &&
+			    z + dz < size.z &&
+			    changed(std::size_t(z + dz) * size.y + y + dy))
+				return true;
+		return false;
+	}
+
+	void mark(int y, int z) {
+		current[std::size_t(z) * size.y + y] = true;
+		current_slices[z] = true;
+	}
+
+	void next_pass() {
+		previous.swap(current);
+		previous_slices.swap(current_slices);
+		std::fill(current.begin(), current.end(), false);
+		std::fill(current_slices.begin(), current_slices.end(), false);
+	}
+};
+
+// sweep_box skipping the rows that cannot change, rows relative to begin in
+// dirty, and the blocks the summary proves settled unless blocks is null.
+// Counts the swept voxels in voxels_swept. Skips the remaining rows once the
+// budget, unless null, is interrupted. visit as in sweep_segment.
+template <bool forward,
+          typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          typename visit_f = no_visit>
+std::size_t sweep_dirty(img_t* data,
+                        const img_t* mask_data,
+                        neigh_f neighbour_fun,
+                        mask_f mask_fun,
+                        const linear_neighbourhood<N>& neigh,
+                        const Vector3d<int>& begin,
+                        const Vector3d<int>& end,
+                        dirty_rows& dirty,
+                        block_summary<img_t>* blocks,
+                        budget* budget_,
+                        std::size_t& voxels_swept,
+                        visit_f visit = {}) {
+	constexpr int edge = block_summary<img_t>::edge;
+	if (blocks)
+		blocks->refresh(neighbour_fun, mask_fun);
+
+	std::size_t changed = 0;
+	std::size_t row_changed = 0;
+	auto sweep_run = [&](int y, int z, int x_begin, int x_end) {
+		std::size_t run_changed =
+		    sweep_segment<forward>(data, mask_data, neighbour_fun, mask_fun,
+		                           neigh, y, z, x_begin, x_end, visit);
+		row_changed += run_changed;
+		voxels_swept += std::size_t(x_end - x_begin);
+		return run_changed;
+	};
+	// sweeps the blocks bx_begin <= bx < bx_end of the row
+	auto sweep_blocks = [&](int y, int z, int bx_begin, int bx_end) {
+		if (sweep_run(y, z, begin.x + bx_begin * edge,
+		              std::min(begin.x + bx_end * edge, end.x)) > 0)
+			blocks->mark_changed(bx_begin, bx_end, (y - begin.y) / edge,
+			                     (z - begin.z) / edge);
+	};
+
+	auto process = [&](int y, int z) {
+		if (!dirty.row_dirty(y - begin.y, z - begin.z) ||
+		    (budget_ != nullptr && budget_->interrupted()))
+			return;
+		row_changed = 0;
+		if (!blocks) {
+			sweep_run(y, z, begin.x, end.x);
+		} else {
+			int by = (y - begin.y) / edge, bz = (z - begin.z) / edge;
+			const int row_blocks = blocks->blocks.x;
+			auto skip = [&](int bx) {
+				return bool(blocks->skippable[blocks->index(bx, by, bz)]);
+			};
+			// maximal runs of blocks to sweep, in the order of the pass
+			if constexpr (forward) {
+				for (int bx = 0; bx < row_blocks;) {
+					if (skip(bx)) {
+						++bx;
+						continue;
+					}
+					int run_end = bx + 1;
+					while (run_end < row_blocks && !skip(run_end))
+						++run_end;
+					sweep_blocks(y, z, bx, run_end);
+					bx = run_end;
+				}
+			} else {
+				for (int bx = row_blocks; bx > 0;) {
+					if (skip(bx - 1)) {
+						--bx;
+						continue;
+					}
+					int run_begin = bx - 1;
+					while (run_begin > 0 && !skip(run_begin - 1))
+						--run_begin;
+					sweep_blocks(y, z, run_begin, bx);
+					bx = run_begin;
+				}
+			}
+		}
+		if (row_changed > 0)
+			dirty.mark(y - begin.y, z - begin.z);
+		changed += row_changed;
+	};
+	if constexpr (forward) {
+		for (int z = begin.z; z < end.z; ++z)
+			if (dirty.slice_dirty(z - begin.z))
+				for (int y = begin.y; y < end.y; ++y)
+					process(y, z);
+	} else {
+		for (int z = end.z - 1; z >= begin.z; --z)
+			if (dirty.slice_dirty(z - begin.z))
+				for (int y = end.y - 1; y >= begin.y; --y)
+					process(y, z);
+	}
+	dirty.next_pass();
+	return changed;
+}
+
+// Visitor of an anti-raster pass queueing the voxels that would still change
+// one of their backward neighbours, the ones the pass updated before them
+// (L. Vincent, 1993).
+template <typename img_t, typename neigh_f, typename mask_f, std::size_t N>
+auto queue_propagating(const img_t* data,
+                       const img_t* mask_data,
+                       neigh_f neighbour_fun,
+                       mask_f mask_fun,
+                       const linear_neighbourhood<N>& backward,
+                       std::queue<std::size_t>& fifo) {
+	return [=, &backward, &fifo](int x, int y, int z, std::size_t idx) {
+		img_t val = data[idx];
+		bool enqueue = false;
+		backward.for_each(x, y, z, idx, [&](std::size_t n) {
+			enqueue = enqueue || mask_fun(neighbour_fun(data[n], val),
+			                              mask_data[n]) != data[n];
+		});
+		if (enqueue)
+			fifo.push(idx);
+	};
+}
+
+// FIFO propagation from the queued voxels to their neighbours in all until
+// the queue is empty, or the budget, unless null, is interrupted.
+template <typename img_t, typename neigh_f, typename mask_f, std::size_t N>
+void propagate_queue(img_t* data,
+                     const img_t* mask_data,
+                     neigh_f neighbour_fun,
+                     mask_f mask_fun,
+                     const linear_neighbourhood<N>& all,
+                     std::queue<std::size_t>& fifo,
+                     budget* budget_) {
+	const Vector3d<int> size = all.size;
+	const std::size_t slice = std::size_t(size.x) * size.y;
+	while (!fifo.empty() &&
+	       (budget_ == nullptr || !budget_->interrupted())) {
+		std::size_t p = fifo.front();
+		fifo.pop();
+		int z = int(p / slice);
+		int y = int(p % slice) / size.x;
+		int x = int(p % size.x);
+		img_t val = data[p];
+		all.for_each(x, y, z, p, [&](std::size_t q) {
+			img_t new_val =
+			    mask_fun(neighbour_fun(data[q], val), mask_data[q]);
+			if (new_val != data[q]) {
+				data[q] = new_val;
+				fifo.push(q);
+			}
+		});
+	}
+}
+
+// Chunks of queued voxels of one thread of propagate_parallel, the owner
+// takes them from the front, thieves from the back.
+struct alignas(64) chunk_deque {
+	std::mutex lock;
+	std::deque<std::vector<std::size_t>> chunks;
+	// chunks.size(), read without the lock by the thieves
+	std::atomic<std::size_t> size = 0;
+};
+
+// propagate_queue spread over threads. Every thread propagates from the
+// voxels of its own chunk in FIFO order and publishes the voxels it queues
+// in chunks to its deque once chunk_size of them gathered. A thread out of
+// work takes the oldest chunk of its deque, keeping the order close to FIFO
+// so that few voxels are raised twice, then the voxels it has not published
+// yet, and otherwise steals the newest half of the chunks of another thread,
+// half of the chunk if it holds just one. Voxels are improved by
+// compare-and-swap max/min, so whichever thread raises a voxel queues it and
+// the result is the one of the serial propagation. The budget, unless null,
+// is polled by the calling thread, while it propagates and while it looks for
+// work, and stops all of them.
+template <typename img_t, typename neigh_f, typename mask_f, std::size_t N>
+void propagate_parallel(img_t* data,
+                        const img_t* mask_data,
+                        neigh_f neighbour_fun,
+                        mask_f mask_fun,
+                        const linear_neighbourhood<N>& all,
+                        std::queue<std::size_t>& fifo,
+                        std::size_t threads,
+                        budget* budget_) {
+	constexpr std::size_t chunk_size = 256;
+	if (threads <= 1 || fifo.size() < 2) {
+		details::propagate_queue(data, mask_data, neighbour_fun, mask_fun,
+		                         all, fifo, budget_);
+		return;
+	}
+
+	const Vector3d<int> size = all.size;
+	const std::size_t slice = std::size_t(size.x) * size.y;
+
+	// the queued voxels dealt to the deques chunk by chunk
+	std::vector<chunk_deque> deques(threads);
+	for (std::size_t k = 0; !fifo.empty(); k = (k + 1) % threads) {
+		std::vector<std::size_t> chunk;
+		while (!fifo.empty() && chunk.size() < chunk_size) {
+			chunk.push_back(fifo.front());
+			fifo.pop();
+		}
+		deques[k].chunks.push_back(std::move(chunk));
+		deques[k].size.store(deques[k].chunks.size(),
+		                     std::memory_order_relaxed);
+	}
+
+	// threads holding work or looking for it under a raised count; the deque
+	// of a thread is empty whenever it is not counted, so all is done once
+	// the count drops to 0
+	std::atomic<std::size_t> active = threads;
+	std::atomic<bool> stop = false;
+
+	auto worker = [&](std::size_t k) {
+		chunk_deque& own = deques[k];
+		std::vector<std::size_t> current, queued;
+		std::size_t next = 0;
+
+		auto publish = [&] {
+			std::lock_guard guard(own.lock);
+			own.chunks.push_back(std::move(queued));
+			own.size.store(own.chunks.size(), std::memory_order_relaxed);
+			queued = {};
+		};
+		// the oldest chunk of the own deque into current
+		auto take = [&] {
+			std::lock_guard guard(own.lock);
+			if (own.chunks.empty())
+				return false;
+			current = std::move(own.chunks.front());
+			own.chunks.pop_front();
+			own.size.store(own.chunks.size(), std::memory_order_relaxed);
+			return true;
+		};
+		// the newest half of the chunks of victim, the oldest one into current
+		auto steal = [&](chunk_deque& victim) {
+			std::vector<std::vector<std::size_t>> stolen;
+			{
+				std::lock_guard guard(victim.lock);
+				std::size_t count = victim.chunks.size();
+				if (count == 0)
+					return false;
+				if (count == 1) {
+					std::vector<std::size_t>& chunk = victim.chunks.back();
+					if (chunk.size() < 2)
+						return false;
+					auto half =
+					    chunk.begin() + std::ptrdiff_t(chunk.size() / 2);
+					stolen.emplace_back(half, chunk.end());
+					chunk.erase(half, chunk.end());
+				} else {
+					stolen.insert(stolen.end(),
+					              std::make_move_iterator(victim.chunks.end() -
+					                                      count / 2),
+					              std::make_move_iterator(victim.chunks.end()));
+					victim.chunks.resize(count - count / 2);
+					victim.size.store(victim.chunks.size(),
+					                  std::memory_order_relaxed);
+				}
+			}
+			current = std::move(stolen.front());
+			std::lock_guard guard(own.lock);
+			for (std::size_t i = 1; i < stolen.size(); ++i)
+				own.chunks.push_back(std::move(stolen[i]));
+			own.size.store(own.chunks.size(), std::memory_order_relaxed);
+			return true;
+		};
+		// false once every thread ran out of work
+		auto find_work = [&] {
+			next = 0;
+			current.clear();
+			if (take())
+				return true;
+			if (!queued.empty()) {
+				current.swap(queued);
+				return true;
+			}
+			active.fetch_sub(1);
+			while (active.load() != 0 &&
+			       !stop.load(std::memory_order_relaxed)) {
+				if (k == 0 && budget_ != nullptr && budget_->interrupted()) {
+					stop.store(true, std::memory_order_relaxed);
+					return false;
+				}
+				for (std::size_t i = 1; i < threads; ++i) {
+					chunk_deque& victim = deques[(k + i) % threads];
+					if (victim.size.load(std::memory_order_relaxed) == 0)
+						continue;
+					active.fetch_add(1);
+					if (steal(victim))
+						return true;
+					active.fetch_sub(1);
+				}
+				std::this_thread::yield();
+			}
+			return false;
+		};
+
+		do {
+			while (next < current.size()) {
+				if (stop.load(std::memory_order_relaxed))
+					return;
+				if (k == 0 && budget_ != nullptr && budget_->interrupted()) {
+					stop.store(true, std::memory_order_relaxed);
+					return;
+				}
+				std::size_t p = current[next++];
+				int z = int(p / slice);
+				int y = int(p % slice) / size.x;
+				int x = int(p % size.x);
+				img_t val = std::atomic_ref<img_t>(data[p]).load(
+				    std::memory_order_relaxed);
+				all.for_each(x, y, z, p, [&](std::size_t q) {
+					std::atomic_ref<img_t> target(data[q]);
+					img_t old = target.load(std::memory_order_relaxed);
+					while (true) {
+						img_t new_val =
+						    mask_fun(neighbour_fun(old, val), mask_data[q]);
+						if (new_val == old)
+							return;
+						if (target.compare_exchange_weak(
+						        old, new_val, std::memory_order_relaxed))
+							break;
+					}
+					queued.push_back(q);
+					if (queued.size() == chunk_size)
+						publish();
+				});
+			}
+		} while (find_work());
+	};
+
+	std::vector<std::thread> workers;
+	for (std::size_t k = 1; k < threads; ++k)
+		workers.emplace_back(worker, k);
+	worker(0);
+	for (auto& t : workers)
+		t.join();
+}
+
+
+// Runs pass() returning the number of changed voxels and records it in
+// stats_ unless that is null. bytes and updates, the voxels swept, are read
+// after the pass.
+template <typename pass_f>
+std::size_t record_pass(stats* stats_,
+                        bool forward,
+                        const std::size_t& bytes,
+                        const std::size_t& updates,
+                        pass_f pass) {
+	if (stats_ == nullptr)
+		return pass();
+	auto start = stats_clock::now();
+	std::size_t changed = pass();
+	stats_->passes.push_back({forward, changed, seconds_since(start), bytes});
+	stats_->iterations += !forward;
+	stats_->bytes += bytes;
+	stats_->updates += updates;
+	return changed;
+}
+
+// Resets the statistics on construction and stores the total time on
+// destruction.
+struct stats_timer {
+	stats* target;
+	stats_clock::time_point start;
+
+	explicit stats_timer(stats* target_) : target(target_) {
+		if (target != nullptr) {
+			*target = {};
+			start = stats_clock::now();
+		}
+	}
+	~stats_timer() {
+		if (target != nullptr)
+			target->seconds = seconds_since(start);
+	}
+};
 } // namespace details
 namespace neighbour_diffs {
 using t3 = std::tuple<int, int, int>;
@@ -99,118 +1093,82 @@ void reconstruction_3d(
     neigh_f neighbour_fun,
     mask_f mask_fun,
     const std::array<std::tuple<int, int, int>, N>& forward_neigh,
-    const std::array<std::tuple<int, int, int>, M>& backward_neigh) {
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh,
+    stats* stats_ = nullptr,
+    bool skip_blocks = false,
+    double queue_fraction = 0,
+    details::budget* budget_ = nullptr) {
 
 	Vector3d<int> size = marker.GetSize();
+	img_t* data = marker.GetFirstVoxelAddr();
+	const img_t* mask_data = mask.GetFirstVoxelAddr();
+	const std::size_t voxel_bytes = 3 * sizeof(img_t);
 
-	auto get_voxel_bound = [size, &marker](int x, int y, int z,
-	                                       img_t default_) {
-		if (!(0 <= x && x < size.x && 0 <= y && y < size.y && 0 <= z &&
-		      z < size.z))
-			return default_;
-		return marker.GetVoxel(x, y, z);
-	};
-
-	auto get_voxel_inner = [&marker](int x, int y, int z) {
-		return marker.GetVoxel(x, y, z);
-	};
+	details::linear_neighbourhood forward(forward_neigh, size);
+	details::linear_neighbourhood backward(backward_neigh, size);
+	details::dirty_rows dirty(
+	    details::concat_arrays(forward_neigh, backward_neigh), size);
+	std::optional<details::block_summary<img_t>> blocks;
+	if (skip_blocks)
+		blocks.emplace(data, mask_data, size, Vector3d<int>(0, 0, 0), size,
+		               forward.reach, neighbour_fun, mask_fun);
+	details::block_summary<img_t>* summary = blocks ? &*blocks : nullptr;
 
-	bool change = true;
+	// every pass but the first two sweeps only the rows next to a change,
+	// skipping the blocks proven settled if asked to; a forward pass changing
+	// fewer than queue_below voxels hands over to the FIFO
+	const std::size_t queue_below =
+	    std::size_t(queue_fraction * double(marker.GetImageSize()));
+	std::size_t swept = 0, bytes = 0, forward_changed = 0;
+	bool change = true, queue = false;
 	while (change) {
-		change = false;
-
-		auto process_bound = [&](int x, int y, int z, const auto& neigh) {
-			img_t center = get_voxel_inner(x, y, z);
-			img_t val = center;
-			for (auto [dx, dy, dz] : neigh)
-				val = neighbour_fun(
-				    get_voxel_bound(x + dx, y + dy, z + dz, val), val);
-			img_t new_val = mask_fun(val, mask.GetVoxel(x, y, z));
-			change |= (center != new_val);
-			marker.SetVoxel(x, y, z, new_val);
-		};
-
 		// ====== forward pass
-		// z == 0
-		for (int y = 0; y < size.y; ++y)
-			for (int x = 0; x < size.x; ++x)
-				process_bound(x, y, 0, forward_neigh);
-
-		// z is inner
-		for (int z = 1; z < size.z - 1; ++z) {
-			// y == 0
-			for (int x = 0; x < size.x; ++x)
-				process_bound(x, 0, z, forward_neigh);
-
-			// y is inner
-			for (int y = 1; y < size.y - 1; ++y) {
-				// x == 0
-				process_bound(0, y, z, forward_neigh);
-				// x is inner
-				for (int x = 1; x < size.x - 1; ++x) {
-					img_t center = get_voxel_inner(x, y, z);
-					img_t val = center;
-					for (auto [dx, dy, dz] : forward_neigh)
-						val = neighbour_fun(
-						    get_voxel_inner(x + dx, y + dy, z + dz), val);
-					img_t new_val = mask_fun(val, mask.GetVoxel(x, y, z));
-					change |= (center != new_val);
-					marker.SetVoxel(x, y, z, new_val);
-				}
-				// x == size.x - 1
-				process_bound(size.x - 1, y, z, forward_neigh);
-			}
-			// y == size.y - 1
-			for (int x = 0; x < size.x; ++x)
-				process_bound(x, size.y - 1, z, forward_neigh);
-		}
-		// z == size.z - 1
-		for (int y = 0; y < size.y; ++y)
-			for (int x = 0; x < size.x; ++x)
-				process_bound(x, y, size.z - 1, forward_neigh);
-
+		if (budget_ != nullptr && !budget_->next_pass())
+			break;
+		change = details::record_pass(stats_, true, bytes, swept, [&] {
+			swept = 0;
+			forward_changed = details::sweep_dirty<true>(
+			    data, mask_data, neighbour_fun, mask_fun, forward,
+			    Vector3d<int>(0, 0, 0), size, dirty, summary, budget_, swept);
+			bytes = swept * voxel_bytes;
+			return forward_changed;
+		}) > 0;
 		// ====== backward pass
-		// z == size.z - 1
-		for (int y = size.y - 1; y >= 0; --y)
-			for (int x = size.x - 1; x >= 0; --x)
-				process_bound(x, y, size.z - 1, backward_neigh);
-
-		// z is inner
-		for (int z = size.z - 2; z > 0; --z) {
-			// y == size.y - 1
-			for (int x = size.x - 1; x >= 0; --x)
-				process_bound(x, size.y - 1, z, backward_neigh);
-
-			// y is inner
-			for (int y = size.y - 2; y > 0; --y) {
-				// x == size.x - 1
-				process_bound(size.x - 1, y, z, backward_neigh);
-
-				// x is inner
-				for (int x = size.x - 2; x > 0; --x) {
-					img_t center = get_voxel_inner(x, y, z);
-					img_t val = center;
-					for (auto [dx, dy, dz] : backward_neigh)
-						val = neighbour_fun(
-						    get_voxel_inner(x + dx, y + dy, z + dz), val);
-					img_t new_val = mask_fun(val, mask.GetVoxel(x, y, z));
-					change |= (center != new_val);
-					marker.SetVoxel(x, y, z, new_val);
-				}
-
-				// x == 0
-				process_bound(0, y, z, backward_neigh);
-			}
-
-			// y == 0
-			for (int x = size.x - 1; x >= 0; --x)
-				process_bound(x, 0, z, backward_neigh);
+		if (budget_ != nullptr && !budget_->next_pass())
+			break;
+		if (forward_changed < queue_below) {
+			queue = true;
+			break;
 		}
+		change |= details::record_pass(stats_, false, bytes, swept, [&] {
+			swept = 0;
+			std::size_t changed = details::sweep_dirty<false>(
+			    data, mask_data, neighbour_fun, mask_fun, backward,
+			    Vector3d<int>(0, 0, 0), size, dirty, summary, budget_, swept);
+			bytes = swept * voxel_bytes;
+			return changed;
+		}) > 0;
+	}
 
-		// z == 0
-		for (int y = size.y - 1; y >= 0; --y)
-			for (int x = size.x - 1; x >= 0; --x)
-				process_bound(x, y, 0, backward_neigh);
+	// ====== backward pass queueing the voxels left to propagate from,
+	// followed by FIFO propagation as in reconstruction_hybrid
+	if (queue) {
+		std::queue<std::size_t> fifo;
+		details::record_pass(stats_, false, bytes, swept, [&] {
+			swept = 0;
+			std::size_t changed = details::sweep_dirty<false>(
+			    data, mask_data, neighbour_fun, mask_fun, backward,
+			    Vector3d<int>(0, 0, 0), size, dirty, summary, budget_, swept,
+			    details::queue_propagating(data, mask_data, neighbour_fun,
+			                               mask_fun, backward, fifo));
+			bytes = swept * voxel_bytes;
+			return changed;
+		});
+		details::propagate_queue(
+		    data, mask_data, neighbour_fun, mask_fun,
+		    details::linear_neighbourhood(
+		        details::concat_arrays(forward_neigh, backward_neigh), size),
+		    fifo, budget_);
 	}
 }
 
@@ -225,90 +1183,14 @@ void reconstruction_2d(
     neigh_f neighbour_fun,
     mask_f mask_fun,
     const std::array<std::tuple<int, int>, N>& forward_neigh,
-    const std::array<std::tuple<int, int>, M>& backward_neigh) {
-
-	Vector3d<int> size = marker.GetSize();
-
-	auto get_voxel_bound = [size, &marker](int x, int y, img_t default_) {
-		if (!(0 <= x && x < size.x && 0 <= y && y < size.y))
-			return default_;
-		return marker.GetVoxel(x, y, 0);
-	};
-
-	auto get_voxel_inner = [&marker](int x, int y) {
-		return marker.GetVoxel(x, y, 0);
-	};
-
-	bool change = true;
-	while (change) {
-		change = false;
-		auto process_bound = [&](int x, int y, const auto& neigh) {
-			img_t center = get_voxel_inner(x, y);
-			img_t val = center;
-			for (auto [dx, dy] : neigh)
-				val = neighbour_fun(get_voxel_bound(x + dx, y + dy, val), val);
-			img_t new_val = mask_fun(val, mask.GetVoxel(x, y, 0));
-			change |= (center != new_val);
-			marker.SetVoxel(x, y, 0, new_val);
-		};
-
-		// ====== forward pass
-		// y == 0
-		for (int x = 0; x < size.x; ++x)
-			process_bound(x, 0, forward_neigh);
-
-		// y is inner
-		for (int y = 1; y < size.y - 1; ++y) {
-			// x == 0
-			process_bound(0, y, forward_neigh);
-
-			// x is inner
-			for (int x = 1; x < size.x - 1; ++x) {
-				img_t center = get_voxel_inner(x, y);
-				img_t val = center;
-				for (auto [dx, dy] : forward_neigh)
-					val = neighbour_fun(get_voxel_inner(x + dx, y + dy), val);
-				img_t new_val = mask_fun(val, mask.GetVoxel(x, y, 0));
-				change |= (center != new_val);
-				marker.SetVoxel(x, y, 0, new_val);
-			}
-
-			// x == size.x - 1
-			process_bound(size.x - 1, y, forward_neigh);
-		}
-
-		// y == size.y - 1
-		for (int x = 0; x < size.x; ++x)
-			process_bound(x, size.y - 1, forward_neigh);
-
-		// ====== backward pass
-		// y == size.y - 1
-		for (int x = size.x - 1; x >= 0; --x)
-			process_bound(x, size.y - 1, backward_neigh);
-
-		// y is inner
-		for (int y = size.y - 2; y > 0; --y) {
-			// x == size.x - 1
-			process_bound(size.x - 1, y, backward_neigh);
-
-			// x is inner
-			for (int x = size.x - 2; x > 0; --x) {
-				img_t center = get_voxel_inner(x, y);
-				img_t val = center;
-				for (auto [dx, dy] : backward_neigh)
-					val = neighbour_fun(get_voxel_inner(x + dx, y + dy), val);
-				img_t new_val = mask_fun(val, mask.GetVoxel(x, y, 0));
-				change |= (center != new_val);
-				marker.SetVoxel(x, y, 0, new_val);
-			}
-			// x == 0
-			process_bound(0, y, backward_neigh);
-		}
-
-		// y == 0
-		for (int x = size.x - 1; x >= 0; --x)
-			process_bound(x, 0, backward_neigh);
-	}
+    const std::array<std::tuple<int, int>, M>& backward_neigh,
+    stats* stats_ = nullptr,
+    double queue_fraction = 0,
+    details::budget* budget_ = nullptr) {
+	fast_morphology::reconstruction_3d(
+	    marker, mask, neighbour_fun, mask_fun, details::to_3d(forward_neigh),
+	    details::to_3d(backward_neigh), stats_, false, queue_fraction,
+	    budget_);
 }
 
 template <typename img_t,
@@ -321,158 +1203,2771 @@ void reconstruction_1d(Image3d<img_t>& marker,
                        neigh_f neighbour_fun,
                        mask_f mask_fun,
                        const std::array<int, N>& forward_neigh,
-                       const std::array<int, M>& backward_neigh) {
+                       const std::array<int, M>& backward_neigh,
+                       stats* stats_ = nullptr,
+                       double queue_fraction = 0,
+                       details::budget* budget_ = nullptr) {
+	fast_morphology::reconstruction_3d(
+	    marker, mask, neighbour_fun, mask_fun, details::to_3d(forward_neigh),
+	    details::to_3d(backward_neigh), stats_, false, queue_fraction,
+	    budget_);
+}
 
-	Vector3d<int> size = marker.GetSize();
+// Raster passes on an internal copy bordered by as many voxels as the
+// neighbourhood reaches along every axis. The border holds the neutral
+// element of neighbour_fun and is never updated, so every voxel takes the
+// branch-free inner kernel.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          std::size_t M>
+void reconstruction_padded(
+    Image3d<img_t>& marker,
+    const Image3d<img_t>& mask,
+    neigh_f neighbour_fun,
+    mask_f mask_fun,
+    const std::array<std::tuple<int, int, int>, N>& forward_neigh,
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh,
+    stats* stats_ = nullptr,
+    bool skip_blocks = false,
+    double queue_fraction = 0,
+    details::budget* budget_ = nullptr) {
 
-	auto get_voxel_bound = [size, &marker](int x, img_t default_) {
-		if (!(0 <= x && x < size.x))
-			return default_;
-		return marker.GetVoxel(x, 0, 0);
-	};
+	const Vector3d<int> size = marker.GetSize();
+	const Vector3d<int> pad =
+	    details::linear_neighbourhood(
+	        details::concat_arrays(forward_neigh, backward_neigh), size)
+	        .reach;
+	const Vector3d<int> padded_size = size + pad * 2;
 
-	auto get_voxel_inner = [&marker](int x) {
-		return marker.GetVoxel(x, 0, 0);
-	};
+	const img_t neutral = details::neutral_element<img_t>(neighbour_fun);
+	const std::size_t padded_voxels =
+	    std::size_t(padded_size.x) * padded_size.y * padded_size.z;
+	std::vector<img_t> data(padded_voxels, neutral);
+	std::vector<img_t> mask_data(padded_voxels, neutral);
 
-	bool change = true;
-	while (change) {
-		change = false;
-
-		auto process_bound = [&](int x, const auto& neigh) {
-			img_t center = get_voxel_inner(x);
-			img_t val = center;
-			for (auto dx : neigh)
-				val = neighbour_fun(get_voxel_bound(x + dx, val), val);
-			img_t new_val = mask_fun(val, mask.GetVoxel(x, 0, 0));
-			change |= (center != new_val);
-			marker.SetVoxel(x, 0, 0, new_val);
-		};
-		// ====== forward pass
-		// x == 0
-		process_bound(0, forward_neigh);
+	// calls fun(image row, padded row) for every row of the image
+	auto for_each_row = [&](auto fun) {
+		for (int z = 0; z < size.z; ++z)
+			for (int y = 0; y < size.y; ++y)
+				fun((std::size_t(z) * size.y + y) * size.x,
+				    (std::size_t(z + pad.z) * padded_size.y + y + pad.y) *
+				            padded_size.x +
+				        pad.x);
+	};
+	for_each_row([&](std::size_t row, std::size_t padded_row) {
+		std::copy_n(marker.GetFirstVoxelAddr() + row, size.x,
+		            data.begin() + padded_row);
+		std::copy_n(mask.GetFirstVoxelAddr() + row, size.x,
+		            mask_data.begin() + padded_row);
+	});
 
-		// x is inner
-		for (int x = 1; x < size.x - 1; ++x) {
-			img_t center = get_voxel_inner(x);
-			img_t val = center;
-			for (auto dx : forward_neigh)
-				val = neighbour_fun(get_voxel_inner(x + dx), val);
-			img_t new_val = mask_fun(val, mask.GetVoxel(x, 0, 0));
-			change |= (center != new_val);
-			marker.SetVoxel(x, 0, 0, new_val);
-		}
+	details::linear_neighbourhood forward(forward_neigh, padded_size);
+	details::linear_neighbourhood backward(backward_neigh, padded_size);
 
-		// x == size.x - 1
-		process_bound(size.x - 1, forward_neigh);
+	details::dirty_rows dirty(
+	    details::concat_arrays(forward_neigh, backward_neigh), size);
+	std::optional<details::block_summary<img_t>> blocks;
+	if (skip_blocks)
+		blocks.emplace(data.data(), mask_data.data(), padded_size, pad,
+		               pad + size, pad, neighbour_fun, mask_fun);
+	details::block_summary<img_t>* summary = blocks ? &*blocks : nullptr;
+	const std::size_t voxel_bytes = 3 * sizeof(img_t);
 
+	// every pass but the first two sweeps only the rows next to a change,
+	// skipping the blocks proven settled if asked to; a forward pass changing
+	// fewer than queue_below voxels hands over to the FIFO
+	const std::size_t queue_below =
+	    std::size_t(queue_fraction * double(marker.GetImageSize()));
+	std::size_t swept = 0, bytes = 0, forward_changed = 0;
+	bool change = true, queue = false;
+	while (change) {
+		// ====== forward pass
+		if (budget_ != nullptr && !budget_->next_pass())
+			break;
+		change = details::record_pass(stats_, true, bytes, swept, [&] {
+			swept = 0;
+			forward_changed = details::sweep_dirty<true>(
+			    data.data(), mask_data.data(), neighbour_fun, mask_fun,
+			    forward, pad, pad + size, dirty, summary, budget_, swept);
+			bytes = swept * voxel_bytes;
+			return forward_changed;
+		}) > 0;
 		// ====== backward pass
-		// x == size.x - 1
-		process_bound(size.x - 1, backward_neigh);
-		// x is inner
-		for (int x = size.x - 2; x > 0; --x) {
-			img_t center = get_voxel_inner(x);
-			img_t val = center;
-			for (auto dx : backward_neigh)
-				val = neighbour_fun(get_voxel_inner(x + dx), val);
-			img_t new_val = mask_fun(val, mask.GetVoxel(x, 0, 0));
-			change |= (center != new_val);
-			marker.SetVoxel(x, 0, 0, new_val);
+		if (budget_ != nullptr && !budget_->next_pass())
+			break;
+		if (forward_changed < queue_below) {
+			queue = true;
+			break;
 		}
+		change |= details::record_pass(stats_, false, bytes, swept, [&] {
+			swept = 0;
+			std::size_t changed = details::sweep_dirty<false>(
+			    data.data(), mask_data.data(), neighbour_fun, mask_fun,
+			    backward, pad, pad + size, dirty, summary, budget_, swept);
+			bytes = swept * voxel_bytes;
+			return changed;
+		}) > 0;
+	}
 
-		// x == 0
-		process_bound(0, backward_neigh);
+	// ====== backward pass queueing the voxels left to propagate from,
+	// followed by FIFO propagation as in reconstruction_hybrid
+	if (queue) {
+		std::queue<std::size_t> fifo;
+		details::record_pass(stats_, false, bytes, swept, [&] {
+			swept = 0;
+			std::size_t changed = details::sweep_dirty<false>(
+			    data.data(), mask_data.data(), neighbour_fun, mask_fun,
+			    backward, pad, pad + size, dirty, summary, budget_, swept,
+			    details::queue_propagating(data.data(), mask_data.data(),
+			                               neighbour_fun, mask_fun, backward,
+			                               fifo));
+			bytes = swept * voxel_bytes;
+			return changed;
+		});
+		details::propagate_queue(
+		    data.data(), mask_data.data(), neighbour_fun, mask_fun,
+		    details::linear_neighbourhood(
+		        details::concat_arrays(forward_neigh, backward_neigh),
+		        padded_size),
+		    fifo, budget_);
 	}
+
+	for_each_row([&](std::size_t row, std::size_t padded_row) {
+		std::copy_n(data.begin() + padded_row, size.x,
+		            marker.GetFirstVoxelAddr() + row);
+	});
 }
 
-template <typename img_t, typename neigh_f, typename mask_f>
-void reconstruction(Image3d<img_t>& marker,
-                    const Image3d<img_t>& mask,
-                    neigh_f neighbour_fun,
-                    mask_f mask_fun,
-                    int cell_adjacency) {
+// Raster passes fused over cache sized tiles: every tile, grown by a halo of
+// passes times the reach of the neighbourhood, gets up to passes forward +
+// backward pass pairs before the next one, so that it is streamed from
+// memory once for all of them. The halo is updated too, which is safe as
+// every update only brings a voxel closer to the result. Rounds over the
+// tiles repeat for those left unsettled or next to a change since their last
+// visit; a round visiting none has converged, one changing few voxels hands
+// over to the FIFO as in reconstruction_3d.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          std::size_t M>
+void reconstruction_blocked(
+    Image3d<img_t>& marker,
+    const Image3d<img_t>& mask,
+    neigh_f neighbour_fun,
+    mask_f mask_fun,
+    const std::array<std::tuple<int, int, int>, N>& forward_neigh,
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh,
+    std::size_t passes,
+    std::size_t tile_size,
+    stats* stats_ = nullptr,
+    double queue_fraction = 0,
+    details::budget* budget_ = nullptr) {
+
+	Vector3d<int> size = marker.GetSize();
+	img_t* data = marker.GetFirstVoxelAddr();
+	const img_t* mask_data = mask.GetFirstVoxelAddr();
+	const std::size_t voxel_bytes = 3 * sizeof(img_t);
+
+	details::linear_neighbourhood forward(forward_neigh, size);
+	details::linear_neighbourhood backward(backward_neigh, size);
+	const Vector3d<int> reach = forward.reach;
+	const int fused = int(std::max<std::size_t>(passes, 1));
+	const Vector3d<int> halo(fused * reach.x, fused * reach.y,
+	                         fused * reach.z);
+	const int tile = int(std::max<std::size_t>(tile_size, 1));
+	const Vector3d<int> tiles((size.x + tile - 1) / tile,
+	                          (size.y + tile - 1) / tile,
+	                          (size.z + tile - 1) / tile);
+	const std::size_t tile_count = std::size_t(tiles.x) * tiles.y * tiles.z;
+	// tiles as far apart as this read voxels the other one writes
+	auto span = [&](int h, int r) { return (2 * h + r + tile - 1) / tile; };
+	const Vector3d<int> near(span(halo.x, reach.x), span(halo.y, reach.y),
+	                         span(halo.z, reach.z));
+
+	// visits are numbered; a tile is visited again if it was not settled by
+	// its last pass pair or a tile near it changed after its last visit
+	std::vector<std::size_t> last_visit(tile_count, 0);
+	std::vector<std::size_t> last_change(tile_count, 0);
+	std::vector<char> settled(tile_count, false);
+	std::size_t visits = 0;
+	auto unsettled = [&](int x, int y, int z) {
+		std::size_t t = (std::size_t(z) * tiles.y + y) * tiles.x + x;
+		if (!settled[t])
+			return true;
+		for (int nz = std::max(z - near.z, 0);
+		     nz <= std::min(z + near.z, tiles.z - 1); ++nz)
+			for (int ny = std::max(y - near.y, 0);
+			     ny <= std::min(y + near.y, tiles.y - 1); ++ny)
+				for (int nx = std::max(x - near.x, 0);
+				     nx <= std::min(x + near.x, tiles.x - 1); ++nx)
+					if (last_change[(std::size_t(nz) * tiles.y + ny) *
+					                    tiles.x +
+					                nx] > last_visit[t])
+						return true;
+		return false;
+	};
+
+	// the halo reads voxels of tiles not visited yet, clamped by the mask
+	// first
+	const std::size_t voxels = marker.GetImageSize();
+	const std::size_t bytes = voxels * voxel_bytes;
+	for (std::size_t i = 0; i < voxels; ++i)
+		data[i] = mask_fun(data[i], mask_data[i]);
+	if (stats_ != nullptr)
+		stats_->bytes += bytes;
+
+	// a visit sweeps only the rows next to a change after its first pair
+	const auto all_neigh =
+	    details::concat_arrays(forward_neigh, backward_neigh);
+	details::block_summary<img_t>* const no_blocks = nullptr;
+	auto visit = [&](std::size_t t, int x, int y, int z) {
+		last_visit[t] = ++visits;
+		Vector3d<int> begin(std::max(x * tile - halo.x, 0),
+		                    std::max(y * tile - halo.y, 0),
+		                    std::max(z * tile - halo.z, 0));
+		Vector3d<int> end(std::min((x + 1) * tile + halo.x, size.x),
+		                  std::min((y + 1) * tile + halo.y, size.y),
+		                  std::min((z + 1) * tile + halo.z, size.z));
+		details::dirty_rows dirty(
+		    all_neigh, Vector3d<int>(end.x - begin.x, end.y - begin.y,
+		                             end.z - begin.z));
+		std::size_t changed = 0, pair_changed = 1, swept = 0;
+		for (int pair = 0; pair < fused && pair_changed > 0; ++pair) {
+			pair_changed = details::sweep_dirty<true>(
+			    data, mask_data, neighbour_fun, mask_fun, forward, begin, end,
+			    dirty, no_blocks, nullptr, swept);
+			pair_changed += details::sweep_dirty<false>(
+			    data, mask_data, neighbour_fun, mask_fun, backward, begin, end,
+			    dirty, no_blocks, nullptr, swept);
+			changed += pair_changed;
+		}
+		settled[t] = pair_changed == 0;
+		if (changed > 0)
+			last_change[t] = visits;
+		if (stats_ != nullptr) {
+			// the grown tile is streamed once, then cached
+			stats_->bytes += std::size_t(end.x - begin.x) *
+			                 (end.y - begin.y) * (end.z - begin.z) *
+			                 voxel_bytes;
+			stats_->updates += swept;
+		}
+		return changed;
+	};
+
+	// a round changing fewer than queue_below voxels hands over to the FIFO
+	const std::size_t queue_below =
+	    std::size_t(queue_fraction * double(voxels));
+	bool visited = true, queue = false;
+	while (visited) {
+		if (budget_ != nullptr && !budget_->next_pass())
+			return;
+		visited = false;
+		std::size_t changed = 0;
+		for (int z = 0; z < tiles.z; ++z)
+			for (int y = 0; y < tiles.y; ++y)
+				for (int x = 0; x < tiles.x; ++x) {
+					if (!unsettled(x, y, z))
+						continue;
+					if (budget_ != nullptr && budget_->interrupted())
+						return;
+					visited = true;
+					std::size_t t =
+					    (std::size_t(z) * tiles.y + y) * tiles.x + x;
+					changed += visit(t, x, y, z);
+				}
+		if (stats_ != nullptr && visited)
+			++stats_->iterations;
+		if (visited && changed < queue_below) {
+			queue = true;
+			break;
+		}
+	}
+
+	// ====== backward pass over the image queueing the voxels left to
+	// propagate from, followed by FIFO propagation as in reconstruction_3d
+	if (queue) {
+		std::queue<std::size_t> fifo;
+		details::record_pass(stats_, false, bytes, voxels, [&] {
+			return details::sweep<false>(
+			    data, mask_data, neighbour_fun, mask_fun, backward,
+			    details::queue_propagating(data, mask_data, neighbour_fun,
+			                               mask_fun, backward, fifo));
+		});
+		details::propagate_queue(
+		    data, mask_data, neighbour_fun, mask_fun,
+		    details::linear_neighbourhood(all_neigh, size), fifo, budget_);
+	}
+}
+
+// Hybrid algorithm (L. Vincent, 1993): one forward and one backward raster
+// pass, the backward one collecting voxels that can still propagate, followed
+// by FIFO propagation, work-stealing over threads. Works for any
+// dimensionality through 3D differences.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          std::size_t M>
+void reconstruction_hybrid(
+    Image3d<img_t>& marker,
+    const Image3d<img_t>& mask,
+    neigh_f neighbour_fun,
+    mask_f mask_fun,
+    const std::array<std::tuple<int, int, int>, N>& forward_neigh,
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh,
+    std::size_t threads = 1,
+    stats* stats_ = nullptr,
+    details::budget* budget_ = nullptr) {
+
+	Vector3d<int> size = marker.GetSize();
+	img_t* data = marker.GetFirstVoxelAddr();
+	const img_t* mask_data = mask.GetFirstVoxelAddr();
+	const std::size_t voxels = marker.GetImageSize();
+	const std::size_t bytes = 3 * voxels * sizeof(img_t);
+
+	details::linear_neighbourhood forward(forward_neigh, size);
+	details::linear_neighbourhood backward(backward_neigh, size);
+	details::linear_neighbourhood all(
+	    details::concat_arrays(forward_neigh, backward_neigh), size);
+
+	// ====== forward pass
+	if (budget_ != nullptr && !budget_->next_pass())
+		return;
+	details::record_pass(stats_, true, bytes, voxels, [&] {
+		return details::sweep<true>(data, mask_data, neighbour_fun, mask_fun,
+		                            forward);
+	});
+
+	// ====== backward pass
+	if (budget_ != nullptr && !budget_->next_pass())
+		return;
+	std::queue<std::size_t> fifo;
+	details::record_pass(stats_, false, bytes, voxels, [&] {
+		return details::sweep<false>(
+		    data, mask_data, neighbour_fun, mask_fun, backward,
+		    details::queue_propagating(data, mask_data, neighbour_fun,
+		                               mask_fun, backward, fifo));
+	});
+
+	// ====== propagation
+	details::propagate_parallel(data, mask_data, neighbour_fun, mask_fun, all,
+	                            fifo, threads, budget_);
+}
+
+// Raster passes with slice z handled by thread z % threads. Row y of slice z
+// is updated once the slices it reads before it are final up to row y + 1
+// (row y - 1 in the backward pass), further for neighbourhoods reaching more
+// than one row, so every voxel sees exactly the values of the serial pass
+// and the result is bit-identical to reconstruction_3d.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          std::size_t M>
+void reconstruction_wavefront(
+    Image3d<img_t>& marker,
+    const Image3d<img_t>& mask,
+    neigh_f neighbour_fun,
+    mask_f mask_fun,
+    const std::array<std::tuple<int, int, int>, N>& forward_neigh,
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh,
+    std::size_t threads,
+    stats* stats_ = nullptr) {
+
+	Vector3d<int> size = marker.GetSize();
+	threads = std::min<std::size_t>(threads, size.z);
+	if (threads <= 1) {
+		fast_morphology::reconstruction_3d(marker, mask, neighbour_fun,
+		                                   mask_fun, forward_neigh,
+		                                   backward_neigh, stats_);
+		return;
+	}
+
+	img_t* data = marker.GetFirstVoxelAddr();
+	const img_t* mask_data = mask.GetFirstVoxelAddr();
+
+	details::linear_neighbourhood forward(forward_neigh, size);
+	details::linear_neighbourhood backward(backward_neigh, size);
+	const Vector3d<int> reach = forward.reach;
+
+	// number of final rows of each slice in the current pass
+	std::vector<std::atomic<int>> rows_done(size.z);
+	std::atomic<std::size_t> changed = 0;
+	bool done = false;
+
+	// passes are recorded by the barrier completions
+	const std::size_t bytes = 3 * marker.GetImageSize() * sizeof(img_t);
+	std::size_t forward_changed = 0;
+	auto pass_start = details::stats_clock::now();
+	auto record = [&](bool forward, std::size_t pass_changed) {
+		if (stats_ == nullptr)
+			return;
+		stats_->passes.push_back({forward, pass_changed,
+		                          details::seconds_since(pass_start), bytes});
+		stats_->iterations += !forward;
+		stats_->bytes += bytes;
+		stats_->updates += marker.GetImageSize();
+		pass_start = details::stats_clock::now();
+	};
+
+	auto reset = [&]() noexcept {
+		for (auto& rows : rows_done)
+			rows.store(0, std::memory_order_relaxed);
+	};
+	auto finish_forward = [&]() noexcept {
+		reset();
+		forward_changed = changed.load();
+		record(true, forward_changed);
+	};
+	auto finish_iteration = [&]() noexcept {
+		reset();
+		std::size_t iteration_changed = changed.exchange(0);
+		record(false, iteration_changed - forward_changed);
+		done = iteration_changed == 0;
+	};
+	std::barrier pass_end(std::ptrdiff_t(threads), finish_forward);
+	std::barrier iteration_end(std::ptrdiff_t(threads), finish_iteration);
+
+	auto wait_rows = [&](int z, int needed) {
+		int current = rows_done[z].load(std::memory_order_acquire);
+		while (current < needed) {
+			rows_done[z].wait(current, std::memory_order_acquire);
+			current = rows_done[z].load(std::memory_order_acquire);
+		}
+	};
+	auto publish_rows = [&](int z, int rows) {
+		rows_done[z].store(rows, std::memory_order_release);
+		rows_done[z].notify_all();
+	};
+
+	auto worker = [&](int first_slice) {
+		const int step = int(threads);
+		int last_slice = first_slice + (size.z - 1 - first_slice) / step * step;
+		while (true) {
+			std::size_t local = 0;
+
+			// ====== forward pass
+			for (int z = first_slice; z < size.z; z += step)
+				for (int y = 0; y < size.y; ++y) {
+					for (int dz = 1; dz <= std::min(reach.z, z); ++dz)
+						wait_rows(z - dz, std::min(y + 1 + reach.y, size.y));
+					local += details::sweep_row<true>(data, mask_data,
+					                                  neighbour_fun, mask_fun,
+					                                  forward, y, z);
+					publish_rows(z, y + 1);
+				}
+			changed += local;
+			local = 0;
+			pass_end.arrive_and_wait();
+
+			// ====== backward pass
+			for (int z = last_slice; z >= 0; z -= step)
+				for (int y = size.y - 1; y >= 0; --y) {
+					for (int dz = 1; dz <= std::min(reach.z, size.z - 1 - z);
+					     ++dz)
+						wait_rows(z + dz,
+						          std::min(size.y - y + reach.y, size.y));
+					local += details::sweep_row<false>(data, mask_data,
+					                                   neighbour_fun, mask_fun,
+					                                   backward, y, z);
+					publish_rows(z, size.y - y);
+				}
+
+			changed += local;
+			iteration_end.arrive_and_wait();
+			if (done)
+				return;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (std::size_t k = 1; k < threads; ++k)
+		workers.emplace_back(worker, int(k));
+	worker(0);
+	for (auto& t : workers)
+		t.join();
+}
+
+// Tiles coloured by the parity of their grid position; tiles of one colour
+// never touch each other, so they are reconstructed to local convergence in
+// parallel directly in the image, reading their halo from the idle tiles
+// around. A tile that changes a voxel of its boundary layer marks the tiles
+// reading it dirty, colours are visited in turn until no tile is dirty.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          std::size_t M>
+void reconstruction_tiled(
+    Image3d<img_t>& marker,
+    const Image3d<img_t>& mask,
+    neigh_f neighbour_fun,
+    mask_f mask_fun,
+    const std::array<std::tuple<int, int, int>, N>& forward_neigh,
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh,
+    std::size_t threads,
+    std::size_t tile_size) {
+
+	Vector3d<int> size = marker.GetSize();
+	img_t* data = marker.GetFirstVoxelAddr();
+	const img_t* mask_data = mask.GetFirstVoxelAddr();
+
+	details::linear_neighbourhood forward(forward_neigh, size);
+	details::linear_neighbourhood backward(backward_neigh, size);
+	// depth of the boundary layer read by the tiles around
+	const Vector3d<int> layer(std::max(forward.reach.x, 1),
+	                         std::max(forward.reach.y, 1),
+	                         std::max(forward.reach.z, 1));
+
+	// tiles of one colour must not reach each other
+	const int tile = std::max({int(std::max<std::size_t>(tile_size, 1)),
+	                           layer.x, layer.y, layer.z});
+	const Vector3d<int> tiles((size.x + tile - 1) / tile,
+	                          (size.y + tile - 1) / tile,
+	                          (size.z + tile - 1) / tile);
+	const std::size_t tile_count = std::size_t(tiles.x) * tiles.y * tiles.z;
+
+	// tile offsets (ox, oy, oz) a boundary voxel can influence: the full
+	// neighbourhood has to reach into that tile along every nonzero axis
+	auto sign = [](int d) { return (d > 0) - (d < 0); };
+	std::array<bool, 27> reaches{};
+	for (const auto& neigh :
+	     details::concat_arrays(forward_neigh, backward_neigh)) {
+		auto [dx, dy, dz] = neigh;
+		for (int o = 0; o < 27; ++o) {
+			int ox = o % 3 - 1, oy = o / 3 % 3 - 1, oz = o / 9 - 1;
+			if ((ox == 0 || ox == sign(dx)) && (oy == 0 || oy == sign(dy)) &&
+			    (oz == 0 || oz == sign(dz)))
+				reaches[o] = true;
+		}
+	}
+
+	std::vector<std::atomic<bool>> dirty(tile_count);
+	for (auto& d : dirty)
+		d.store(true, std::memory_order_relaxed);
+
+	auto process_tile = [&](std::size_t t, std::vector<img_t>& boundary) {
+		Vector3d<int> pos(int(t % tiles.x), int(t / tiles.x % tiles.y),
+		                  int(t / tiles.x / tiles.y));
+		Vector3d<int> begin = pos * tile;
+		Vector3d<int> end(std::min(begin.x + tile, size.x),
+		                  std::min(begin.y + tile, size.y),
+		                  std::min(begin.z + tile, size.z));
+		dirty[t].store(false, std::memory_order_relaxed);
+
+		// whether c lies within depth of the face b or e - 1
+		auto on_face = [](int c, int b, int e, int depth) {
+			return c < b + depth || c >= e - depth;
+		};
+		// calls fun(x, y, z, idx) for the boundary layer of the tile
+		auto for_each_boundary = [&](auto fun) {
+			for (int z = begin.z; z < end.z; ++z)
+				for (int y = begin.y; y < end.y; ++y) {
+					std::size_t row = (std::size_t(z) * size.y + y) * size.x;
+					bool whole_row = on_face(z, begin.z, end.z, layer.z) ||
+					                 on_face(y, begin.y, end.y, layer.y);
+					int inner_end = std::max(end.x - layer.x, begin.x);
+					for (int x = begin.x; x < end.x;
+					     x = whole_row || x + 1 < begin.x + layer.x ||
+					                 x + 1 >= inner_end
+					             ? x + 1
+					             : inner_end)
+						fun(x, y, z, row + x);
+				}
+		};
+
+		boundary.clear();
+		for_each_boundary([&](int, int, int, std::size_t idx) {
+			boundary.push_back(data[idx]);
+		});
+
+		std::size_t changed = 1;
+		while (changed > 0) {
+			changed = details::sweep_box<true>(data, mask_data, neighbour_fun,
+			                                   mask_fun, forward, begin, end);
+			changed += details::sweep_box<false>(data, mask_data,
+			                                     neighbour_fun, mask_fun,
+			                                     backward, begin, end);
+		}
+
+		std::size_t i = 0;
+		for_each_boundary([&](int x, int y, int z, std::size_t idx) {
+			if (boundary[i++] == data[idx])
+				return;
+			// whether the voxel lies in the layer towards offset -1 / 0 / +1
+			auto faces = [](int c, int b, int e, int o, int depth) {
+				return o == 0 || (o < 0 ? c < b + depth : c >= e - depth);
+			};
+			for (int o = 0; o < 27; ++o) {
+				int ox = o % 3 - 1, oy = o / 3 % 3 - 1, oz = o / 9 - 1;
+				if (o == 13 || !reaches[o] ||
+				    !faces(x, begin.x, end.x, ox, layer.x) ||
+				    !faces(y, begin.y, end.y, oy, layer.y) ||
+				    !faces(z, begin.z, end.z, oz, layer.z))
+					continue;
+				Vector3d<int> n(pos.x + ox, pos.y + oy, pos.z + oz);
+				if (0 <= n.x && n.x < tiles.x && 0 <= n.y && n.y < tiles.y &&
+				    0 <= n.z && n.z < tiles.z)
+					dirty[(std::size_t(n.z) * tiles.y + n.y) * tiles.x + n.x]
+					    .store(true, std::memory_order_relaxed);
+			}
+		});
+	};
+
+	// ====== scheduling, run by one thread between the colour phases
+	std::vector<std::size_t> work;
+	std::atomic<std::size_t> next_work = 0;
+	int colour = -1;
+	bool done = false;
+	auto plan = [&]() noexcept {
+		work.clear();
+		next_work.store(0, std::memory_order_relaxed);
+		for (int c = 1; c <= 8 && work.empty(); ++c) {
+			int candidate = (colour + c) % 8;
+			for (std::size_t t = 0; t < tile_count; ++t) {
+				int tile_colour = int(t % tiles.x % 2) +
+				                  2 * int(t / tiles.x % tiles.y % 2) +
+				                  4 * int(t / tiles.x / tiles.y % 2);
+				if (tile_colour == candidate &&
+				    dirty[t].load(std::memory_order_relaxed))
+					work.push_back(t);
+			}
+			if (!work.empty())
+				colour = candidate;
+		}
+		done = work.empty();
+	};
+
+	threads = std::max<std::size_t>(std::min(threads, tile_count), 1);
+	std::barrier phase_end(std::ptrdiff_t(threads), plan);
+	auto worker = [&](std::size_t k) {
+		// the halo of a tile has to be clamped by the mask before it is read,
+		// the raster passes get this from their processing order
+		std::size_t voxels = marker.GetImageSize();
+		for (std::size_t i = voxels * k / threads,
+		                 i_end = voxels * (k + 1) / threads;
+		     i < i_end; ++i)
+			data[i] = mask_fun(data[i], mask_data[i]);
+
+		std::vector<img_t> boundary;
+		while (true) {
+			phase_end.arrive_and_wait();
+			if (done)
+				return;
+			for (std::size_t i; (i = next_work++) < work.size();)
+				process_tile(work[i], boundary);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (std::size_t k = 1; k < threads; ++k)
+		workers.emplace_back(worker, k);
+	worker(0);
+	for (auto& t : workers)
+		t.join();
+}
+
+// Chaotic relaxation: blocks of block_size^3 voxels are swept to local
+// convergence by whichever thread claims them dirty while scanning the
+// shared list of block states, with no barrier between sweeps. A change
+// within reach of the block faces marks the blocks holding the neighbours of
+// the voxel dirty, a block marked while being swept is swept again by its
+// owner. Voxels only improve (rise for dilation) towards the fixed point of
+// the reconstruction, so the result does not depend on the schedule.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          std::size_t M>
+void reconstruction_chaotic(
+    Image3d<img_t>& marker,
+    const Image3d<img_t>& mask,
+    neigh_f neighbour_fun,
+    mask_f mask_fun,
+    const std::array<std::tuple<int, int, int>, N>& forward_neigh,
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh,
+    std::size_t threads,
+    std::size_t block_size) {
+
+	Vector3d<int> size = marker.GetSize();
+	img_t* data = marker.GetFirstVoxelAddr();
+	const img_t* mask_data = mask.GetFirstVoxelAddr();
+
+	details::linear_neighbourhood forward(forward_neigh, size);
+	details::linear_neighbourhood backward(backward_neigh, size);
+	const auto all = details::concat_arrays(forward_neigh, backward_neigh);
+	const Vector3d<int> reach = forward.reach;
+
+	const int edge = int(std::max<std::size_t>(block_size, 1));
+	const Vector3d<int> blocks((size.x + edge - 1) / edge,
+	                           (size.y + edge - 1) / edge,
+	                           (size.z + edge - 1) / edge);
+	const std::size_t block_count =
+	    std::size_t(blocks.x) * blocks.y * blocks.z;
+	auto block_of = [&](int x, int y, int z) {
+		return (std::size_t(z / edge) * blocks.y + y / edge) * blocks.x +
+		       x / edge;
+	};
+
+	// state bits of every block, the blocks not clean are pending
+	enum : std::uint8_t { clean = 0, dirty = 1, busy = 2 };
+	std::vector<std::atomic<std::uint8_t>> state(block_count);
+	for (auto& st : state)
+		st.store(dirty, std::memory_order_relaxed);
+	std::atomic<std::size_t> pending = block_count;
+	// the marking thread has a busy block pending, so pending cannot drop
+	// to 0 before the count is raised
+	auto mark = [&](std::size_t b) {
+		if (state[b].fetch_or(dirty, std::memory_order_acq_rel) == clean)
+			pending.fetch_add(1, std::memory_order_relaxed);
+	};
+
+	// only the owner of its block writes a voxel, the others read it as halo
+	auto load = [&](std::size_t idx) {
+		return std::atomic_ref<img_t>(data[idx]).load(
+		    std::memory_order_relaxed);
+	};
+	auto store = [&](std::size_t idx, img_t val) {
+		std::atomic_ref<img_t>(data[idx]).store(val,
+		                                        std::memory_order_relaxed);
+	};
+
+	auto process_block = [&](std::size_t b) {
+		Vector3d<int> pos(int(b % blocks.x), int(b / blocks.x % blocks.y),
+		                  int(b / blocks.x / blocks.y));
+		Vector3d<int> begin = pos * edge;
+		Vector3d<int> end(std::min(begin.x + edge, size.x),
+		                  std::min(begin.y + edge, size.y),
+		                  std::min(begin.z + edge, size.z));
+		auto near_face = [](int c, int b_, int e, int depth) {
+			return c < b_ + depth || c >= e - depth;
+		};
+
+		// voxels of the boundary layer, read by the threads around
+		auto relax = [&](const auto& neigh, int x, int y, int z) {
+			std::size_t idx = (std::size_t(z) * size.y + y) * size.x + x;
+			img_t old = load(idx);
+			img_t val = old;
+			neigh.for_each(x, y, z, idx, [&](std::size_t n) {
+				val = neighbour_fun(load(n), val);
+			});
+			val = mask_fun(val, mask_data[idx]);
+			if (val == old)
+				return false;
+			store(idx, val);
+			if (near_face(x, begin.x, end.x, reach.x) ||
+			    near_face(y, begin.y, end.y, reach.y) ||
+			    near_face(z, begin.z, end.z, reach.z))
+				for (auto [dx, dy, dz] : all)
+					if (forward.contains(x + dx, y + dy, z + dz) &&
+					    block_of(x + dx, y + dy, z + dz) != b)
+						mark(block_of(x + dx, y + dy, z + dz));
+			return true;
+		};
+
+		// the voxels deeper inside are private to the owner and take the
+		// row kernels of the raster passes
+		auto relax_row = [&](auto direction, const auto& neigh, int y,
+		                     int z) {
+			constexpr bool forward_row = decltype(direction)::value;
+			int inner_begin = std::min(begin.x + reach.x, end.x);
+			int inner_end = std::max(end.x - reach.x, inner_begin);
+			if (near_face(y, begin.y, end.y, reach.y) ||
+			    near_face(z, begin.z, end.z, reach.z))
+				inner_begin = inner_end = end.x;
+			auto inner = [&] {
+				return details::sweep_segment<forward_row>(
+				    data, mask_data, neighbour_fun, mask_fun, neigh, y, z,
+				    inner_begin, inner_end);
+			};
+			std::size_t changed = 0;
+			if constexpr (forward_row) {
+				for (int x = begin.x; x < inner_begin; ++x)
+					changed += relax(neigh, x, y, z);
+				changed += inner();
+				for (int x = inner_end; x < end.x; ++x)
+					changed += relax(neigh, x, y, z);
+			} else {
+				for (int x = end.x - 1; x >= inner_end; --x)
+					changed += relax(neigh, x, y, z);
+				changed += inner();
+				for (int x = inner_begin - 1; x >= begin.x; --x)
+					changed += relax(neigh, x, y, z);
+			}
+			return changed;
+		};
+
+		std::size_t changed = 1;
+		while (changed > 0) {
+			changed = 0;
+			for (int z = begin.z; z < end.z; ++z)
+				for (int y = begin.y; y < end.y; ++y)
+					changed += relax_row(std::true_type(), forward, y, z);
+			for (int z = end.z - 1; z >= begin.z; --z)
+				for (int y = end.y - 1; y >= begin.y; --y)
+					changed += relax_row(std::false_type(), backward, y, z);
+		}
+	};
+
+	threads = std::max<std::size_t>(std::min(threads, block_count), 1);
+	// the neighbours read have to be clamped by the mask first
+	std::latch clamped{std::ptrdiff_t(threads)};
+	auto worker = [&](std::size_t k) {
+		std::size_t voxels = marker.GetImageSize();
+		for (std::size_t i = voxels * k / threads,
+		                 i_end = voxels * (k + 1) / threads;
+		     i < i_end; ++i)
+			data[i] = mask_fun(data[i], mask_data[i]);
+		clamped.arrive_and_wait();
+
+		// threads scan the list from spread out positions
+		std::size_t b = block_count * k / threads;
+		std::size_t idle = 0;
+		while (pending.load(std::memory_order_acquire) != 0) {
+			b = b + 1 < block_count ? b + 1 : 0;
+			std::uint8_t expected = dirty;
+			if (state[b].load(std::memory_order_relaxed) != dirty ||
+			    !state[b].compare_exchange_strong(expected, busy,
+			                                      std::memory_order_acq_rel)) {
+				if (++idle >= block_count) {
+					std::this_thread::yield();
+					idle = 0;
+				}
+				continue;
+			}
+			idle = 0;
+			while (true) {
+				process_block(b);
+				expected = busy;
+				if (state[b].compare_exchange_strong(
+				        expected, clean, std::memory_order_acq_rel))
+					break;
+				// marked while swept
+				state[b].exchange(busy, std::memory_order_acq_rel);
+			}
+			pending.fetch_sub(1, std::memory_order_acq_rel);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (std::size_t k = 1; k < threads; ++k)
+		workers.emplace_back(worker, k);
+	worker(0);
+	for (auto& t : workers)
+		t.join();
+}
+
+// Voxels coloured so that no two neighbours share a colour: by the parity
+// of x + y + z (red-black) if every neighbour lies an odd number of steps
+// away, as in the 6-neighbourhood, otherwise by their position modulo the
+// reach plus one along every axis. The colours are updated in turn, a voxel
+// from all its neighbours at once; the voxels of one colour do not depend on
+// each other, so the threads split them by tiles and the rows are computed
+// with contiguous vectorisable loops, their other colours discarded. Only
+// the tiles next to a tile changed since their colour last ran are visited.
+// Takes more iterations than the raster passes, each fully parallel.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          std::size_t M>
+void reconstruction_checkerboard(
+    Image3d<img_t>& marker,
+    const Image3d<img_t>& mask,
+    neigh_f neighbour_fun,
+    mask_f mask_fun,
+    const std::array<std::tuple<int, int, int>, N>& forward_neigh,
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh,
+    std::size_t threads,
+    std::size_t tile_size) {
+
+	Vector3d<int> size = marker.GetSize();
+	img_t* data = marker.GetFirstVoxelAddr();
+	const img_t* mask_data = mask.GetFirstVoxelAddr();
+
+	const auto all_neigh =
+	    details::concat_arrays(forward_neigh, backward_neigh);
+	details::linear_neighbourhood all(all_neigh, size);
+	const Vector3d<int> reach = all.reach;
+
+	// ====== colouring: lanes x = residue + k * step of the rows of a colour
+	bool red_black = true;
+	for (auto [dx, dy, dz] : all_neigh)
+		red_black =
+		    red_black && (std::abs(dx) + std::abs(dy) + std::abs(dz)) % 2 != 0;
+	const Vector3d<int> period(reach.x + 1, reach.y + 1, reach.z + 1);
+	const int colours = red_black ? 2 : period.x * period.y * period.z;
+	const int step = red_black ? 2 : period.x;
+	// residue of the lanes of colour c in row (y, z), -1 if it has none
+	auto lanes = [&](int c, int y, int z) {
+		if (red_black)
+			return (c + y + z) % 2;
+		if (y % period.y != c / period.x % period.y ||
+		    z % period.z != c / period.x / period.y)
+			return -1;
+		return c % period.x;
+	};
+
+	// updates the lanes of the row (y, z) of the tile begin <= (x, y, z) <
+	// end, acc holds a row of the tile. Whole rows are read only where the
+	// neighbourhood stays inside the tile, the lanes next to the faces read
+	// their neighbours one by one: the voxels of the colour in the tiles
+	// around are written meanwhile
+	auto update_lanes = [&](int y, int z, const Vector3d<int>& begin,
+	                        const Vector3d<int>& end, int residue,
+	                        img_t* acc) {
+		const std::size_t row = (std::size_t(z) * size.y + y) * size.x;
+		std::size_t changed = 0;
+		auto update = [&](int x, img_t val) {
+			img_t new_val = mask_fun(val, mask_data[row + x]);
+			changed += new_val != data[row + x];
+			data[row + x] = new_val;
+		};
+		auto update_bound = [&](int x) {
+			img_t val = data[row + x];
+			all.for_each(x, y, z, row + x, [&](std::size_t n) {
+				val = neighbour_fun(data[n], val);
+			});
+			update(x, val);
+		};
+		// first lane at or after x
+		auto lane = [&](int x) {
+			return x + ((residue - x) % step + step) % step;
+		};
+
+		// lanes inner_begin <= x < inner_end have all neighbours inside
+		// the tile
+		int inner_begin = end.x, inner_end = end.x;
+		if (begin.y + reach.y <= y && y < end.y - reach.y &&
+		    begin.z + reach.z <= z && z < end.z - reach.z) {
+			inner_begin = lane(begin.x + reach.x);
+			inner_end = end.x - reach.x;
+		}
+		int x = lane(begin.x);
+		for (; x < std::min(inner_begin, end.x); x += step)
+			update_bound(x);
+		if (x < inner_end) {
+			const std::size_t length = std::size_t(inner_end - x);
+			const img_t* centre = data + row + x;
+			std::copy_n(centre, length, acc);
+			details::unroll<N + M>([&](std::size_t i) {
+				const img_t* neighbour = centre + all.offsets[i];
+				for (std::size_t j = 0; j < length; ++j)
+					acc[j] = neighbour_fun(acc[j], neighbour[j]);
+			});
+			for (std::size_t j = 0; j < length; j += step)
+				update(x + int(j), acc[j]);
+			x = lane(inner_end);
+		}
+		for (; x < end.x; x += step)
+			update_bound(x);
+		return changed;
+	};
+
+	// ====== tiles, dirty if changed in the previous or the current
+	// iteration; the tiles have to reach as far as the neighbourhood
+	const int tile = std::max({int(std::max<std::size_t>(tile_size, 1)),
+	                           reach.x, reach.y, reach.z});
+	const Vector3d<int> tiles((size.x + tile - 1) / tile,
+	                          (size.y + tile - 1) / tile,
+	                          (size.z + tile - 1) / tile);
+	const std::size_t tile_count = std::size_t(tiles.x) * tiles.y * tiles.z;
+	std::vector<std::atomic<bool>> previous(tile_count), current(tile_count);
+	for (std::size_t t = 0; t < tile_count; ++t) {
+		previous[t].store(true, std::memory_order_relaxed);
+		current[t].store(false, std::memory_order_relaxed);
+	}
+
+	auto process_tile = [&](std::size_t t, int c, img_t* acc) {
+		Vector3d<int> begin(int(t % tiles.x) * tile,
+		                    int(t / tiles.x % tiles.y) * tile,
+		                    int(t / tiles.x / tiles.y) * tile);
+		Vector3d<int> end(std::min(begin.x + tile, size.x),
+		                  std::min(begin.y + tile, size.y),
+		                  std::min(begin.z + tile, size.z));
+		std::size_t changed = 0;
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y) {
+				int residue = lanes(c, y, z);
+				if (residue >= 0)
+					changed += update_lanes(y, z, begin, end, residue, acc);
+			}
+		if (changed > 0)
+			current[t].store(true, std::memory_order_relaxed);
+		return changed;
+	};
+
+	// ====== scheduling, run by one thread between the colour phases
+	std::vector<std::size_t> work;
+	std::atomic<std::size_t> next_work = 0;
+	std::atomic<std::size_t> phase_changed = 0;
+	std::size_t iteration_changed = 0;
+	int colour = -1;
+	bool done = false;
+	auto plan = [&]() noexcept {
+		iteration_changed += phase_changed.exchange(0);
+		if (++colour == colours) {
+			if (iteration_changed == 0) {
+				done = true;
+				return;
+			}
+			colour = 0;
+			iteration_changed = 0;
+			for (std::size_t t = 0; t < tile_count; ++t) {
+				previous[t].store(current[t].load(std::memory_order_relaxed),
+				                  std::memory_order_relaxed);
+				current[t].store(false, std::memory_order_relaxed);
+			}
+		}
+		auto dirty = [&](int x, int y, int z) {
+			std::size_t t = (std::size_t(z) * tiles.y + y) * tiles.x + x;
+			return previous[t].load(std::memory_order_relaxed) ||
+			       current[t].load(std::memory_order_relaxed);
+		};
+		work.clear();
+		next_work.store(0, std::memory_order_relaxed);
+		for (int z = 0; z < tiles.z; ++z)
+			for (int y = 0; y < tiles.y; ++y)
+				for (int x = 0; x < tiles.x; ++x) {
+					bool visit = false;
+					for (int nz = std::max(z - 1, 0);
+					     nz <= std::min(z + 1, tiles.z - 1) && !visit; ++nz)
+						for (int ny = std::max(y - 1, 0);
+						     ny <= std::min(y + 1, tiles.y - 1) && !visit; ++ny)
+							for (int nx = std::max(x - 1, 0);
+							     nx <= std::min(x + 1, tiles.x - 1) && !visit;
+							     ++nx)
+								visit = dirty(nx, ny, nz);
+					if (visit)
+						work.push_back((std::size_t(z) * tiles.y + y) *
+						                   tiles.x +
+						               x);
+				}
+	};
+
+	threads = std::max<std::size_t>(std::min(threads, tile_count), 1);
+	std::barrier phase_end(std::ptrdiff_t(threads), plan);
+	auto worker = [&](std::size_t k) {
+		// the neighbours read have to be clamped by the mask first
+		std::size_t voxels = marker.GetImageSize();
+		for (std::size_t i = voxels * k / threads,
+		                 i_end = voxels * (k + 1) / threads;
+		     i < i_end; ++i)
+			data[i] = mask_fun(data[i], mask_data[i]);
+
+		auto acc = std::make_unique_for_overwrite<img_t[]>(std::size_t(tile));
+		while (true) {
+			phase_end.arrive_and_wait();
+			if (done)
+				return;
+			std::size_t changed = 0;
+			for (std::size_t i; (i = next_work++) < work.size();)
+				changed += process_tile(work[i], colour, acc.get());
+			phase_changed += changed;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (std::size_t k = 1; k < threads; ++k)
+		workers.emplace_back(worker, k);
+	worker(0);
+	for (auto& t : workers)
+		t.join();
+}
+
+namespace details {
+// Indices of the voxels of the box begin <= (x, y, z) < end of an image of
+// the given size, written to order sorted by mask value so that
+// mask_fun(mask[a], mask[b]) is mask[a] for a before b, i.e. root of the
+// component tree first.
+template <typename idx_t, typename img_t, typename mask_f>
+void sort_by_mask(const img_t* mask_data,
+                  const Vector3d<int>& size,
+                  const Vector3d<int>& begin,
+                  const Vector3d<int>& end,
+                  idx_t* order,
+                  mask_f mask_fun) {
+	// min as the mask function: increasing values
+	const bool increasing = mask_fun(img_t(0), img_t(1)) == img_t(0);
+	auto for_each_voxel = [&](auto fun) {
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y) {
+				std::size_t row = (std::size_t(z) * size.y + y) * size.x;
+				for (int x = begin.x; x < end.x; ++x)
+					fun(row + x);
+			}
+	};
+
+	if constexpr (std::is_integral_v<img_t> && !std::is_same_v<img_t, bool> &&
+	              sizeof(img_t) <= 2) {
+		// counting sort
+		typedef std::make_unsigned_t<img_t> key_t;
+		constexpr std::size_t levels =
+		    std::size_t(std::numeric_limits<key_t>::max()) + 1;
+		auto key = [&](std::size_t i) {
+			key_t k = key_t(mask_data[i]);
+			if constexpr (std::is_signed_v<img_t>)
+				k ^= key_t(1) << (sizeof(key_t) * 8 - 1);
+			return increasing ? k : key_t(~k);
+		};
+		std::vector<std::size_t> start(levels + 1, 0);
+		for_each_voxel(
+		    [&](std::size_t i) { ++start[std::size_t(key(i)) + 1]; });
+		for (std::size_t l = 0; l < levels; ++l)
+			start[l + 1] += start[l];
+		for_each_voxel(
+		    [&](std::size_t i) { order[start[key(i)]++] = idx_t(i); });
+	} else {
+		std::size_t count = 0;
+		for_each_voxel([&](std::size_t i) { order[count++] = idx_t(i); });
+		std::sort(order, order + count, [&](idx_t a, idx_t b) {
+			return mask_data[a] != mask_data[b] &&
+			       mask_fun(mask_data[a], mask_data[b]) == mask_data[a];
+		});
+	}
+}
+
+template <typename idx_t,
+          typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N>
+void union_find_reconstruction(img_t* data,
+                               const img_t* mask_data,
+                               neigh_f neighbour_fun,
+                               mask_f mask_fun,
+                               const linear_neighbourhood<N>& all) {
+	const Vector3d<int> size = all.size;
+	const std::size_t voxels = std::size_t(size.x) * size.y * size.z;
+	const std::size_t slice = std::size_t(size.x) * size.y;
+
+	for (std::size_t i = 0; i < voxels; ++i)
+		data[i] = mask_fun(data[i], mask_data[i]);
+
+	std::vector<idx_t> order(voxels);
+	sort_by_mask(mask_data, size, Vector3d<int>(0, 0, 0), size, order.data(),
+	             mask_fun);
+
+	// ====== component tree of the mask, leaves (last in order) first
+	// union by rank on zpar, repr holds the tree root of every set
+	const idx_t none = std::numeric_limits<idx_t>::max();
+	std::vector<idx_t> parent(voxels);
+	std::vector<idx_t> zpar(voxels, none);
+	std::vector<idx_t> repr(voxels);
+	std::vector<std::uint8_t> rank(voxels, 0);
+	auto find_root = [&](idx_t p) {
+		while (zpar[p] != p) {
+			// path halving
+			zpar[p] = zpar[zpar[p]];
+			p = zpar[p];
+		}
+		return p;
+	};
+	for (std::size_t i = voxels; i-- > 0;) {
+		idx_t p = order[i];
+		parent[p] = p;
+		zpar[p] = p;
+		repr[p] = p;
+		idx_t set = p;
+		int z = int(p / slice);
+		int y = int(p % slice) / size.x;
+		int x = int(p % size.x);
+		all.for_each(x, y, z, p, [&](std::size_t n) {
+			if (zpar[n] == none)
+				return;
+			idx_t r = find_root(idx_t(n));
+			if (r == set)
+				return;
+			parent[repr[r]] = p;
+			if (rank[set] < rank[r])
+				std::swap(set, r);
+			else if (rank[set] == rank[r])
+				++rank[set];
+			zpar[r] = set;
+			repr[set] = p;
+		});
+	}
+	zpar = std::vector<idx_t>();
+	repr = std::vector<idx_t>();
+	rank = std::vector<std::uint8_t>();
+
+	// every voxel points to the canonical voxel of its parent component
+	for (idx_t p : order) {
+		idx_t q = parent[p];
+		if (mask_data[parent[q]] == mask_data[q])
+			parent[p] = parent[q];
+	}
+
+	// ====== marker extremum of every component, collected from the leaves
+	for (std::size_t i = voxels; i-- > 0;) {
+		idx_t p = order[i];
+		if (parent[p] != p)
+			data[parent[p]] = neighbour_fun(data[parent[p]], data[p]);
+	}
+
+	// ====== reconstruction: the best of the component's own extremum cut by
+	// its level and the parent component's result
+	for (idx_t p : order) {
+		idx_t q = parent[p];
+		if (q == p)
+			data[p] = mask_fun(data[p], mask_data[p]);
+		else if (mask_data[q] == mask_data[p])
+			data[p] = data[q];
+		else
+			data[p] =
+			    neighbour_fun(mask_fun(data[p], mask_data[p]), data[q]);
+	}
+}
+
+// Calls fun(i) for every 0 <= i < count, spread over threads.
+template <typename fun_t>
+void parallel_for(std::size_t threads, std::size_t count, fun_t fun) {
+	std::atomic<std::size_t> next = 0;
+	auto worker = [&] {
+		for (std::size_t i; (i = next++) < count;)
+			fun(i);
+	};
+	threads = std::max<std::size_t>(std::min(threads, count), 1);
+	std::vector<std::thread> workers;
+	for (std::size_t k = 1; k < threads; ++k)
+		workers.emplace_back(worker);
+	worker();
+	for (auto& t : workers)
+		t.join();
+}
+
+// union_find_reconstruction over blocks of edge^3 voxels: the component
+// trees of the blocks are built concurrently, then joined along the block
+// faces by merging the ancestor chains of neighbouring voxels (M. Wilkinson
+// et al., 2008). Groups of blocks are joined pairwise along x, y and z in
+// turn, the joins of one round run in parallel. The marker extremum of every
+// component is carried along the merged chains, the results are then
+// resolved root first by the threads, each component once.
+template <typename idx_t,
+          typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N>
+void union_find_blocks(img_t* data,
+                       const img_t* mask_data,
+                       neigh_f neighbour_fun,
+                       mask_f mask_fun,
+                       const linear_neighbourhood<N>& all,
+                       int edge,
+                       std::size_t threads) {
+	const Vector3d<int> size = all.size;
+	const std::size_t voxels = std::size_t(size.x) * size.y * size.z;
+	const std::size_t slice = std::size_t(size.x) * size.y;
+	const Vector3d<int> blocks((size.x + edge - 1) / edge,
+	                           (size.y + edge - 1) / edge,
+	                           (size.z + edge - 1) / edge);
+	const std::size_t block_count =
+	    std::size_t(blocks.x) * blocks.y * blocks.z;
+	auto component = [](auto& v, int axis) -> auto& {
+		return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+	};
+	auto inside = [](int x, int y, int z, const Vector3d<int>& begin,
+	                 const Vector3d<int>& end) {
+		return begin.x <= x && x < end.x && begin.y <= y && y < end.y &&
+		       begin.z <= z && z < end.z;
+	};
+
+	// every voxel is written by the block owning it before it is read, so
+	// the arrays are left uninitialised
+	const idx_t none = std::numeric_limits<idx_t>::max();
+	auto parent = std::make_unique_for_overwrite<idx_t[]>(voxels);
+	auto zpar = std::make_unique_for_overwrite<idx_t[]>(voxels);
+	auto repr = std::make_unique_for_overwrite<idx_t[]>(voxels);
+	// union by rank while the trees are built, whether the result of the
+	// component is known while they are resolved
+	auto rank = std::make_unique_for_overwrite<std::uint8_t[]>(voxels);
+
+	// ====== component tree of every block, as union_find_reconstruction
+	parallel_for(threads, block_count, [&](std::size_t b) {
+		Vector3d<int> begin(int(b % blocks.x) * edge,
+		                    int(b / blocks.x % blocks.y) * edge,
+		                    int(b / blocks.x / blocks.y) * edge);
+		Vector3d<int> end(std::min(begin.x + edge, size.x),
+		                  std::min(begin.y + edge, size.y),
+		                  std::min(begin.z + edge, size.z));
+		auto for_each_voxel = [&](auto fun) {
+			for (int z = begin.z; z < end.z; ++z)
+				for (int y = begin.y; y < end.y; ++y) {
+					std::size_t row = (std::size_t(z) * size.y + y) * size.x;
+					for (int x = begin.x; x < end.x; ++x)
+						fun(row + x);
+				}
+		};
+		for_each_voxel([&](std::size_t i) {
+			data[i] = mask_fun(data[i], mask_data[i]);
+			zpar[i] = none;
+			rank[i] = 0;
+		});
+		const std::size_t count = std::size_t(end.x - begin.x) *
+		                          (end.y - begin.y) * (end.z - begin.z);
+		std::vector<idx_t> order(count);
+		sort_by_mask(mask_data, size, begin, end, order.data(), mask_fun);
+
+		auto find_root = [&](idx_t p) {
+			while (zpar[p] != p) {
+				zpar[p] = zpar[zpar[p]];
+				p = zpar[p];
+			}
+			return p;
+		};
+		for (std::size_t i = count; i-- > 0;) {
+			idx_t p = order[i];
+			parent[p] = p;
+			zpar[p] = p;
+			repr[p] = p;
+			idx_t set = p;
+			int z = int(p / slice);
+			int y = int(p % slice) / size.x;
+			int x = int(p % size.x);
+			unroll<N>([&](std::size_t k) {
+				auto [dx, dy, dz] = all.coords[k];
+				if (!inside(x + dx, y + dy, z + dz, begin, end))
+					return;
+				std::size_t n = p + all.offsets[k];
+				if (zpar[n] == none)
+					return;
+				idx_t r = find_root(idx_t(n));
+				if (r == set)
+					return;
+				parent[repr[r]] = p;
+				if (rank[set] < rank[r])
+					std::swap(set, r);
+				else if (rank[set] == rank[r])
+					++rank[set];
+				zpar[r] = set;
+				repr[set] = p;
+			});
+		}
+		for (idx_t p : order) {
+			idx_t q = parent[p];
+			if (mask_data[parent[q]] == mask_data[q])
+				parent[p] = parent[q];
+		}
+		for (std::size_t i = count; i-- > 0;) {
+			idx_t p = order[i];
+			if (parent[p] != p)
+				data[parent[p]] = neighbour_fun(data[parent[p]], data[p]);
+		}
+		for_each_voxel([&](std::size_t i) { rank[i] = 0; });
+	});
+	zpar.reset();
+	repr.reset();
+
+	// ====== joins; the extremum of a component, kept in data at its level
+	// root (the voxel of its level whose parent is of another level), covers
+	// its subtree
+	// whether the level of voxel a lies further from the root than that of b
+	auto deeper = [&](idx_t a, idx_t b) {
+		return mask_data[a] != mask_data[b] &&
+		       mask_fun(mask_data[a], mask_data[b]) == mask_data[b];
+	};
+	auto level_root = [&](idx_t p) {
+		idx_t r = p;
+		while (parent[r] != r && mask_data[parent[r]] == mask_data[r])
+			r = parent[r];
+		while (p != r) {
+			idx_t next = parent[p];
+			parent[p] = r;
+			p = next;
+		}
+		return r;
+	};
+	// merges the chains of ancestors of the neighbours x and y by level
+	auto connect = [&](idx_t x, idx_t y) {
+		x = level_root(x);
+		y = level_root(y);
+		if (deeper(y, x))
+			std::swap(x, y);
+		// x lies at least as deep as y
+		while (x != y) {
+			idx_t z = parent[x] == x ? none : level_root(parent[x]);
+			if (z != none && !deeper(y, z)) {
+				data[z] = neighbour_fun(data[z], data[x]);
+				x = z;
+				continue;
+			}
+			parent[x] = y;
+			data[y] = neighbour_fun(data[y], data[x]);
+			if (z == none) {
+				// the tree of x hangs below y, whose ancestors gain its
+				// extremum up to the first one that has it already
+				while (parent[y] != y) {
+					idx_t a = level_root(parent[y]);
+					if (neighbour_fun(data[a], data[y]) == data[a])
+						break;
+					data[a] = neighbour_fun(data[a], data[y]);
+					y = a;
+				}
+				return;
+			}
+			x = y;
+			y = z;
+		}
+	};
+
+	for (int axis = 0; axis < 3; ++axis) {
+		const int along = component(blocks, axis);
+		// blocks along the axes joined later, every one a group of its own
+		std::size_t groups = 1;
+		for (int a = axis + 1; a < 3; ++a)
+			groups *= std::size_t(component(blocks, a));
+		const int depth = component(all.reach, axis);
+
+		for (int width = 1; width < along; width *= 2) {
+			const std::size_t pairs =
+			    std::size_t((along - width + 2 * width - 1) / (2 * width));
+			parallel_for(threads, pairs * groups, [&](std::size_t t) {
+				// the groups span the whole image along the axes joined
+				// before, a block along those joined later
+				Vector3d<int> begin(0, 0, 0), end = size;
+				std::size_t g = t / pairs;
+				for (int a = axis + 1; a < 3; ++a) {
+					int n = component(blocks, a);
+					component(begin, a) = int(g % n) * edge;
+					component(end, a) =
+					    std::min(component(begin, a) + edge,
+					             component(size, a));
+					g /= n;
+				}
+				int lo = int(t % pairs) * 2 * width;
+				int mid = (lo + width) * edge;
+				component(begin, axis) = std::max(lo * edge, mid - depth);
+				component(end, axis) = mid;
+				Vector3d<int> far_end = end;
+				component(far_end, axis) =
+				    std::min((lo + 2 * width) * edge,
+				             component(size, axis));
+				Vector3d<int> far_begin = begin;
+				component(far_begin, axis) = mid;
+
+				for (int z = begin.z; z < end.z; ++z)
+					for (int y = begin.y; y < end.y; ++y)
+						for (int x = begin.x; x < end.x; ++x) {
+							std::size_t p =
+							    (std::size_t(z) * size.y + y) * size.x + x;
+							for (std::size_t k = 0; k < N; ++k) {
+								auto [dx, dy, dz] = all.coords[k];
+								if (inside(x + dx, y + dy, z + dz, far_begin,
+								           far_end))
+									connect(idx_t(p),
+									        idx_t(p + all.offsets[k]));
+							}
+						}
+			});
+		}
+	}
+
+	// ====== results, root first: the component's extremum cut by its level
+	// or the result of its parent, whichever is better. A result recomputed
+	// from itself stays the same, so a component resolved by two threads at
+	// once is harmless
+	auto load = [&](idx_t p) {
+		return std::atomic_ref<img_t>(data[p]).load(std::memory_order_relaxed);
+	};
+	auto resolved = [&](idx_t p) {
+		return std::atomic_ref<std::uint8_t>(rank[p]).load(
+		           std::memory_order_acquire) != 0;
+	};
+	// level_root without compressing the paths, read only
+	auto find_level_root = [&](idx_t p) {
+		while (parent[p] != p && mask_data[parent[p]] == mask_data[p])
+			p = parent[p];
+		return p;
+	};
+	parallel_for(threads, block_count, [&](std::size_t b) {
+		Vector3d<int> begin(int(b % blocks.x) * edge,
+		                    int(b / blocks.x % blocks.y) * edge,
+		                    int(b / blocks.x / blocks.y) * edge);
+		Vector3d<int> end(std::min(begin.x + edge, size.x),
+		                  std::min(begin.y + edge, size.y),
+		                  std::min(begin.z + edge, size.z));
+		std::vector<idx_t> path;
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+				for (int x = begin.x; x < end.x; ++x) {
+					idx_t p = idx_t((std::size_t(z) * size.y + y) * size.x + x);
+					idx_t r = find_level_root(p);
+					// the unresolved ancestors of r
+					path.clear();
+					for (idx_t a = r; !resolved(a);) {
+						path.push_back(a);
+						if (parent[a] == a)
+							break;
+						a = find_level_root(parent[a]);
+					}
+					while (!path.empty()) {
+						idx_t c = path.back();
+						path.pop_back();
+						img_t val = mask_fun(load(c), mask_data[c]);
+						if (parent[c] != c)
+							val = neighbour_fun(
+							    val, load(find_level_root(parent[c])));
+						std::atomic_ref<img_t>(data[c]).store(
+						    val, std::memory_order_relaxed);
+						std::atomic_ref<std::uint8_t>(rank[c]).store(
+						    1, std::memory_order_release);
+					}
+					if (p != r)
+						std::atomic_ref<img_t>(data[p]).store(
+						    load(r), std::memory_order_relaxed);
+				}
+	});
+}
+} // namespace details
+
+// Reconstruction from the component tree of the mask built by union-find
+// over the voxels sorted by mask value. The result of a component is the
+// marker extremum inside it cut by its level, or the result of its parent if
+// that is better. The cost does not depend on the image geometry. With more
+// than one thread the trees of blocks of block_size^3 voxels are built in
+// parallel and joined along the block faces.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          std::size_t M>
+void reconstruction_union_find(
+    Image3d<img_t>& marker,
+    const Image3d<img_t>& mask,
+    neigh_f neighbour_fun,
+    mask_f mask_fun,
+    const std::array<std::tuple<int, int, int>, N>& forward_neigh,
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh,
+    std::size_t threads = 1,
+    std::size_t block_size = 64) {
+
+	details::linear_neighbourhood all(
+	    details::concat_arrays(forward_neigh, backward_neigh),
+	    Vector3d<int>(marker.GetSize()));
+	const int edge = int(std::max<std::size_t>(block_size, 1));
+	const bool blocks = threads > 1 && (all.size.x > edge ||
+	                                    all.size.y > edge || all.size.z > edge);
+
+	// 32-bit indices halve the memory traffic where they suffice
+	auto run = [&](auto index) {
+		typedef decltype(index) idx_t;
+		if (blocks)
+			details::union_find_blocks<idx_t>(
+			    marker.GetFirstVoxelAddr(), mask.GetFirstVoxelAddr(),
+			    neighbour_fun, mask_fun, all, edge, threads);
+		else
+			details::union_find_reconstruction<idx_t>(
+			    marker.GetFirstVoxelAddr(), mask.GetFirstVoxelAddr(),
+			    neighbour_fun, mask_fun, all);
+	};
+	if (marker.GetImageSize() < std::numeric_limits<std::uint32_t>::max())
+		run(std::uint32_t());
+	else
+		run(std::size_t());
+}
+
+// Downhill filter of Robinson & Whelan: voxels are kept in one list per grey
+// level and the levels are processed from the best (highest for dilation)
+// one. A popped voxel of level n raises its worse neighbours to the level n
+// cut by their mask and lists them at their new level, every voxel is final
+// once its level is reached. Integer images of up to 16 bits only.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          std::size_t N,
+          std::size_t M>
+void reconstruction_downhill(
+    Image3d<img_t>& marker,
+    const Image3d<img_t>& mask,
+    neigh_f neighbour_fun,
+    mask_f mask_fun,
+    const std::array<std::tuple<int, int, int>, N>& forward_neigh,
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh) {
+
+	if constexpr (!std::is_integral_v<img_t> || std::is_same_v<img_t, bool> ||
+	              sizeof(img_t) > 2) {
+		throw InternalException(
+		    "Downhill filter needs an 8 or 16 bit integer image!");
+	} else {
+		Vector3d<int> size = marker.GetSize();
+		img_t* data = marker.GetFirstVoxelAddr();
+		const img_t* mask_data = mask.GetFirstVoxelAddr();
+		const std::size_t voxels = marker.GetImageSize();
+		const std::size_t slice = std::size_t(size.x) * size.y;
+
+		details::linear_neighbourhood all(
+		    details::concat_arrays(forward_neigh, backward_neigh), size);
+
+		// level of a value, the best value (max for dilation) on top
+		typedef std::make_unsigned_t<img_t> key_t;
+		const bool dilation = neighbour_fun(img_t(0), img_t(1)) == img_t(1);
+		auto level = [&](img_t v) {
+			key_t k = key_t(v);
+			if constexpr (std::is_signed_v<img_t>)
+				k ^= key_t(1) << (sizeof(key_t) * 8 - 1);
+			return std::size_t(dilation ? k : key_t(~k));
+		};
+		constexpr std::size_t levels =
+		    std::size_t(std::numeric_limits<key_t>::max()) + 1;
+
+		std::vector<std::size_t> histogram(levels, 0);
+		for (std::size_t i = 0; i < voxels; ++i) {
+			data[i] = mask_fun(data[i], mask_data[i]);
+			++histogram[level(data[i])];
+		}
+		std::vector<std::vector<std::size_t>> lists(levels);
+		for (std::size_t l = 1; l < levels; ++l)
+			lists[l].reserve(histogram[l]);
+		histogram = std::vector<std::size_t>();
+		// the worst level cannot raise anything
+		for (std::size_t i = 0; i < voxels; ++i)
+			if (std::size_t l = level(data[i]); l > 0)
+				lists[l].push_back(i);
+
+		for (std::size_t l = levels; l-- > 1;) {
+			std::vector<std::size_t>& list = lists[l];
+			// the list grows while it is processed
+			for (std::size_t i = 0; i < list.size(); ++i) {
+				std::size_t p = list[i];
+				img_t val = data[p];
+				// listed at a lower level before it was raised
+				if (level(val) != l)
+					continue;
+				int z = int(p / slice);
+				int y = int(p % slice) / size.x;
+				int x = int(p % size.x);
+				all.for_each(x, y, z, p, [&](std::size_t q) {
+					img_t new_val =
+					    mask_fun(neighbour_fun(data[q], val), mask_data[q]);
+					if (new_val != data[q]) {
+						data[q] = new_val;
+						lists[level(new_val)].push_back(q);
+					}
+				});
+			}
+			list = std::vector<std::size_t>();
+		}
+	}
+}
+
+namespace details {
+// Binary volume with 64 voxels per word, voxel x of a row in bit x % 64 of
+// word x / 64. Rows are padded to whole words, padding bits stay 0.
+struct packed_volume {
+	Vector3d<int> size;
+	std::size_t row_words;
+	std::vector<std::uint64_t> words;
+
+	packed_volume(const bool* data, Vector3d<int> size_, bool invert)
+	    : size(size_), row_words((std::size_t(size_.x) + 63) / 64),
+	      words(row_words * size_.y * size_.z, 0) {
+		for (int z = 0; z < size.z; ++z)
+			for (int y = 0; y < size.y; ++y) {
+				const bool* src = data + row_index(y, z) * size.x;
+				std::uint64_t* dst = row(y, z);
+				for (int x = 0; x < size.x; ++x)
+					dst[x / 64] |= std::uint64_t(src[x] != invert) << (x % 64);
+			}
+	}
+
+	void unpack(bool* data, bool invert) const {
+		for (int z = 0; z < size.z; ++z)
+			for (int y = 0; y < size.y; ++y) {
+				bool* dst = data + row_index(y, z) * size.x;
+				const std::uint64_t* src = row(y, z);
+				for (int x = 0; x < size.x; ++x)
+					dst[x] = bool((src[x / 64] >> (x % 64)) & 1) != invert;
+			}
+	}
+
+	std::size_t row_index(int y, int z) const {
+		return std::size_t(z) * size.y + y;
+	}
+	std::uint64_t* row(int y, int z) {
+		return words.data() + row_index(y, z) * row_words;
+	}
+	const std::uint64_t* row(int y, int z) const {
+		return words.data() + row_index(y, z) * row_words;
+	}
+};
+
+// bits of g spread towards higher (up) or lower bits inside the runs of p
+template <bool up>
+inline std::uint64_t fill_runs(std::uint64_t g, std::uint64_t p) {
+	for (int k = 1; k < 64; k *= 2) {
+		if constexpr (up) {
+			g |= p & (g << k);
+			p &= p << k;
+		} else {
+			g |= p & (g >> k);
+			p &= p >> k;
+		}
+	}
+	return g;
+}
+
+// sets every run of mask bits in the row that contains a bit of seed
+inline void
+fill_row(std::uint64_t* seed, const std::uint64_t* mask, std::size_t words) {
+	std::uint64_t carry = 0;
+	for (std::size_t w = 0; w < words; ++w) {
+		seed[w] = fill_runs<true>(seed[w] | (carry & mask[w]), mask[w]);
+		carry = seed[w] >> 63;
+	}
+	carry = 0;
+	for (std::size_t w = words; w-- > 0;) {
+		seed[w] =
+		    fill_runs<false>(seed[w] | ((carry << 63) & mask[w]), mask[w]);
+		carry = seed[w] & 1;
+	}
+}
+
+// acc |= row read at x + dx for every voxel x, dx in {-1, 0, 1}
+inline void or_shifted(std::uint64_t* acc,
+                       const std::uint64_t* row,
+                       std::size_t words,
+                       int dx) {
+	if (dx == 0)
+		for (std::size_t w = 0; w < words; ++w)
+			acc[w] |= row[w];
+	else if (dx < 0)
+		for (std::size_t w = 0; w < words; ++w)
+			acc[w] |= row[w] << 1 | (w > 0 ? row[w - 1] >> 63 : 0);
+	else
+		for (std::size_t w = 0; w < words; ++w)
+			acc[w] |= row[w] >> 1 | (w + 1 < words ? row[w + 1] << 63 : 0);
+}
+
+// whether the packed passes apply to the forward neighbourhood: its in-row
+// neighbour is the previous voxel and the others lie at most one voxel aside
+template <std::size_t N>
+bool packs_rows(const std::array<std::tuple<int, int, int>, N>& neigh) {
+	bool previous = false;
+	for (auto [dx, dy, dz] : neigh) {
+		if (dx < -1 || dx > 1 || (dy == 0 && dz == 0 && dx != -1))
+			return false;
+		previous = previous || (dy == 0 && dz == 0);
+	}
+	return previous;
+}
+
+// One raster pass over the rows of a packed reconstruction by dilation. The
+// neighbours in other rows are ORed in word-wide, the in-row ones are
+// replaced by filling whole mask runs. Returns the number of changed voxels.
+// Skips the remaining rows once the budget, unless null, is interrupted.
+template <bool forward, std::size_t N>
+std::size_t binary_pass(packed_volume& marker,
+                        const packed_volume& mask,
+                        const std::array<std::tuple<int, int, int>, N>& neigh,
+                        std::vector<std::uint64_t>& acc,
+                        budget* budget_) {
+	const Vector3d<int> size = marker.size;
+	const std::size_t words = marker.row_words;
+	std::size_t changed = 0;
+
+	auto process = [&](int y, int z) {
+		if (budget_ != nullptr && budget_->interrupted())
+			return;
+		std::uint64_t* row = marker.row(y, z);
+		const std::uint64_t* mask_row = mask.row(y, z);
+		std::copy(row, row + words, acc.begin());
+		for (auto [dx, dy, dz] : neigh) {
+			if ((dy == 0 && dz == 0) || y + dy < 0 || y + dy >= size.y ||
+			    z + dz < 0 || z + dz >= size.z)
+				continue;
+			or_shifted(acc.data(), marker.row(y + dy, z + dz), words, dx);
+		}
+		for (std::size_t w = 0; w < words; ++w)
+			acc[w] &= mask_row[w];
+		fill_row(acc.data(), mask_row, words);
+		for (std::size_t w = 0; w < words; ++w) {
+			changed += std::size_t(std::popcount(acc[w] ^ row[w]));
+			row[w] = acc[w];
+		}
+	};
+
+	if constexpr (forward) {
+		for (int z = 0; z < size.z; ++z)
+			for (int y = 0; y < size.y; ++y)
+				process(y, z);
+	} else {
+		for (int z = size.z - 1; z >= 0; --z)
+			for (int y = size.y - 1; y >= 0; --y)
+				process(y, z);
+	}
+	return changed;
+}
+} // namespace details
+
+// Raster passes of a binary image packed to 64 voxels per word. Reconstruction
+// by erosion is done as the dilation of the complements.
+template <typename neigh_f, typename mask_f, std::size_t N, std::size_t M>
+void reconstruction_binary(
+    Image3d<bool>& marker,
+    const Image3d<bool>& mask,
+    neigh_f neighbour_fun,
+    mask_f /*mask_fun*/,
+    const std::array<std::tuple<int, int, int>, N>& forward_neigh,
+    const std::array<std::tuple<int, int, int>, M>& backward_neigh,
+    stats* stats_ = nullptr,
+    details::budget* budget_ = nullptr) {
+
+	const Vector3d<int> size = marker.GetSize();
+	const bool invert = !neighbour_fun(false, true);
+	details::packed_volume packed_marker(marker.GetFirstVoxelAddr(), size,
+	                                     invert);
+	const details::packed_volume packed_mask(mask.GetFirstVoxelAddr(), size,
+	                                         invert);
+	for (std::size_t w = 0; w < packed_marker.words.size(); ++w)
+		packed_marker.words[w] &= packed_mask.words[w];
+
+	std::vector<std::uint64_t> acc(packed_marker.row_words);
+	const std::size_t bytes = 3 * packed_marker.words.size() * 8;
+	const std::size_t voxels = marker.GetImageSize();
+	bool change = true;
+	while (change) {
+		if (budget_ != nullptr && !budget_->next_pass())
+			break;
+		change = details::record_pass(stats_, true, bytes, voxels, [&] {
+			return details::binary_pass<true>(packed_marker, packed_mask,
+			                                  forward_neigh, acc, budget_);
+		}) > 0;
+		if (budget_ != nullptr && !budget_->next_pass())
+			break;
+		change |= details::record_pass(stats_, false, bytes, voxels, [&] {
+			return details::binary_pass<false>(packed_marker, packed_mask,
+			                                   backward_neigh, acc, budget_);
+		}) > 0;
+	}
+	packed_marker.unpack(marker.GetFirstVoxelAddr(), invert);
+}
+
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          typename diff_t,
+          std::size_t N,
+          std::size_t M>
+void reconstruction_engine(Image3d<img_t>& marker,
+                           const Image3d<img_t>& mask,
+                           neigh_f neighbour_fun,
+                           mask_f mask_fun,
+                           const std::array<diff_t, N>& forward_neigh,
+                           const std::array<diff_t, M>& backward_neigh,
+                           const options& options_,
+                           details::budget* budget_) {
+	switch (options_.engine) {
+	case engine::raster:
+		if constexpr (std::is_same_v<img_t, bool>) {
+			if (details::packs_rows(details::to_3d(forward_neigh)))
+				fast_morphology::reconstruction_binary(
+				    marker, mask, neighbour_fun, mask_fun,
+				    details::to_3d(forward_neigh),
+				    details::to_3d(backward_neigh), options_.stats, budget_);
+			else
+				fast_morphology::reconstruction_3d(
+				    marker, mask, neighbour_fun, mask_fun,
+				    details::to_3d(forward_neigh),
+				    details::to_3d(backward_neigh), options_.stats, false,
+				    options_.queue_fraction, budget_);
+		} else if (options_.fused_passes > 0)
+			fast_morphology::reconstruction_blocked(
+			    marker, mask, neighbour_fun, mask_fun,
+			    details::to_3d(forward_neigh), details::to_3d(backward_neigh),
+			    options_.fused_passes, options_.tile_size, options_.stats,
+			    options_.queue_fraction, budget_);
+		else if (options_.padded)
+			fast_morphology::reconstruction_padded(
+			    marker, mask, neighbour_fun, mask_fun,
+			    details::to_3d(forward_neigh), details::to_3d(backward_neigh),
+			    options_.stats, options_.skip_blocks, options_.queue_fraction,
+			    budget_);
+		else if constexpr (std::is_same_v<diff_t, std::tuple<int, int, int>>)
+			fast_morphology::reconstruction_3d(
+			    marker, mask, neighbour_fun, mask_fun, forward_neigh,
+			    backward_neigh, options_.stats, options_.skip_blocks,
+			    options_.queue_fraction, budget_);
+		else if constexpr (std::is_same_v<diff_t, std::tuple<int, int>>)
+			fast_morphology::reconstruction_2d(
+			    marker, mask, neighbour_fun, mask_fun, forward_neigh,
+			    backward_neigh, options_.stats, options_.queue_fraction,
+			    budget_);
+		else
+			fast_morphology::reconstruction_1d(
+			    marker, mask, neighbour_fun, mask_fun, forward_neigh,
+			    backward_neigh, options_.stats, options_.queue_fraction,
+			    budget_);
+		break;
+	case engine::hybrid:
+		fast_morphology::reconstruction_hybrid(
+		    marker, mask, neighbour_fun, mask_fun,
+		    details::to_3d(forward_neigh), details::to_3d(backward_neigh),
+		    options_.threads != 0 ? options_.threads : GetNumberOfProcessors(),
+		    options_.stats, budget_);
+		break;
+	case engine::wavefront:
+		fast_morphology::reconstruction_wavefront(
+		    marker, mask, neighbour_fun, mask_fun,
+		    details::to_3d(forward_neigh), details::to_3d(backward_neigh),
+		    options_.threads != 0 ? options_.threads : GetNumberOfProcessors(),
+		    options_.stats);
+		break;
+	case engine::tiled:
+		fast_morphology::reconstruction_tiled(
+		    marker, mask, neighbour_fun, mask_fun,
+		    details::to_3d(forward_neigh), details::to_3d(backward_neigh),
+		    options_.threads != 0 ? options_.threads : GetNumberOfProcessors(),
+		    options_.tile_size);
+		break;
+	case engine::chaotic:
+		fast_morphology::reconstruction_chaotic(
+		    marker, mask, neighbour_fun, mask_fun,
+		    details::to_3d(forward_neigh), details::to_3d(backward_neigh),
+		    options_.threads != 0 ? options_.threads : GetNumberOfProcessors(),
+		    options_.tile_size);
+		break;
+	case engine::checkerboard:
+		fast_morphology::reconstruction_checkerboard(
+		    marker, mask, neighbour_fun, mask_fun,
+		    details::to_3d(forward_neigh), details::to_3d(backward_neigh),
+		    options_.threads != 0 ? options_.threads : GetNumberOfProcessors(),
+		    options_.tile_size);
+		break;
+	case engine::union_find:
+		fast_morphology::reconstruction_union_find(
+		    marker, mask, neighbour_fun, mask_fun,
+		    details::to_3d(forward_neigh), details::to_3d(backward_neigh),
+		    options_.threads != 0 ? options_.threads : GetNumberOfProcessors(),
+		    options_.tile_size);
+		break;
+	case engine::downhill:
+		fast_morphology::reconstruction_downhill(
+		    marker, mask, neighbour_fun, mask_fun,
+		    details::to_3d(forward_neigh), details::to_3d(backward_neigh));
+		break;
+	default:
+		throw InternalException("Unknown reconstruction engine!");
+	}
+}
+
+namespace details {
+// Calls fun(forward, backward) with the neighbour differences of the raster
+// passes for an image of the given size; images of one voxel have none.
+template <typename fun_t>
+void with_neighbourhood(const Vector3d<int>& size,
+                        int cell_adjacency,
+                        fun_t fun) {
 	// 3D image
-	if (marker.GetSizeZ() > 1) {
+	if (size.z > 1) {
 		switch (cell_adjacency) {
 		case 0:
-			fast_morphology::reconstruction_3d(
-			    marker, mask, neighbour_fun, mask_fun,
-			    fast_morphology::neighbour_diffs::forward_3d_0,
-			    fast_morphology::neighbour_diffs::backward_3d_0);
+			fun(neighbour_diffs::forward_3d_0, neighbour_diffs::backward_3d_0);
 			break;
 		case 1:
-			fast_morphology::reconstruction_3d(
-			    marker, mask, neighbour_fun, mask_fun,
-			    fast_morphology::neighbour_diffs::forward_3d_1,
-			    fast_morphology::neighbour_diffs::backward_3d_1);
+			fun(neighbour_diffs::forward_3d_1, neighbour_diffs::backward_3d_1);
 			break;
 		case 2:
-			fast_morphology::reconstruction_3d(
-			    marker, mask, neighbour_fun, mask_fun,
-			    fast_morphology::neighbour_diffs::forward_3d_2,
-			    fast_morphology::neighbour_diffs::backward_3d_2);
+			fun(neighbour_diffs::forward_3d_2, neighbour_diffs::backward_3d_2);
 			break;
 		default:
 			throw InternalException(
 			    "Invalid cell neighbourhood for 3D image! (valid: {0, 1, 2})");
 		}
-	} else if (marker.GetSizeY() > 1) { // 2D image
+	} else if (size.y > 1) { // 2D image
 		switch (cell_adjacency) {
 		case 0:
-			fast_morphology::reconstruction_2d(
-			    marker, mask, neighbour_fun, mask_fun,
-			    fast_morphology::neighbour_diffs::forward_2d_0,
-			    fast_morphology::neighbour_diffs::backward_2d_0);
+			fun(neighbour_diffs::forward_2d_0, neighbour_diffs::backward_2d_0);
 			break;
 		case 1:
-			fast_morphology::reconstruction_2d(
-			    marker, mask, neighbour_fun, mask_fun,
-			    fast_morphology::neighbour_diffs::forward_2d_1,
-			    fast_morphology::neighbour_diffs::backward_2d_1);
+			fun(neighbour_diffs::forward_2d_1, neighbour_diffs::backward_2d_1);
 			break;
 		default:
 			throw InternalException(
 			    "Invalid cell neighbourhood for 2D image! (valid: {0, 1})");
 		}
-	} else if (marker.GetSizeX() > 1) { // 1D image
+	} else if (size.x > 1) { // 1D image
 		if (cell_adjacency != 0)
 			throw InternalException(
 			    "Invalid cell neighbourhood for 1D image! (valid: {0})");
 
-		fast_morphology::reconstruction_1d(
-		    marker, mask, neighbour_fun, mask_fun,
-		    fast_morphology::neighbour_diffs::forward_1d_0,
-		    fast_morphology::neighbour_diffs::backward_1d_0);
+		fun(neighbour_diffs::forward_1d_0, neighbour_diffs::backward_1d_0);
+	}
+}
+
+// Calls fun(forward, backward) with the offsets of neighbourhood joined by
+// their reflections, as the adjacencies are symmetric, and split by the
+// raster order. Offsets that never fit in the image are dropped. The halves
+// are padded to a power of two by repeating a neighbour, harmless to max and
+// min, so that only a few sizes are instantiated; a neighbourhood left empty
+// is the origin alone, which clamps the marker by the mask.
+template <typename fun_t>
+void with_neighbourhood(const Vector3d<int>& size,
+                        const Neighbourhood& neighbourhood,
+                        fun_t fun) {
+	typedef std::tuple<int, int, int> diff_t;
+	std::vector<diff_t> half;
+	for (const Vector3d<int>& o : neighbourhood.offset) {
+		if (std::abs(o.x) >= size.x || std::abs(o.y) >= size.y ||
+		    std::abs(o.z) >= size.z || (o.x == 0 && o.y == 0 && o.z == 0))
+			continue;
+		// the neighbours before the voxel in raster order
+		diff_t diff{o.x, o.y, o.z};
+		if (std::tuple{o.z, o.y, o.x} > std::tuple{0, 0, 0})
+			diff = {-o.x, -o.y, -o.z};
+		if (std::find(half.begin(), half.end(), diff) == half.end())
+			half.push_back(diff);
+	}
+	if (half.empty())
+		half.emplace_back(0, 0, 0);
+
+	auto run = [&](auto capacity) {
+		constexpr std::size_t N = decltype(capacity)::value;
+		// the spare entries repeat a neighbour in another row if there is
+		// one, the in-row neighbour has to stay unique for the row kernels
+		auto spare = std::find_if(half.begin(), half.end(), [](diff_t d) {
+			return std::get<1>(d) != 0 || std::get<2>(d) != 0;
+		});
+		std::array<diff_t, N> forward;
+		forward.fill(spare != half.end() ? *spare : half.front());
+		std::copy(half.begin(), half.end(), forward.begin());
+		fun(forward, negate_coords(forward));
+	};
+	if (half.size() <= 4)
+		run(std::integral_constant<std::size_t, 4>());
+	else if (half.size() <= 8)
+		run(std::integral_constant<std::size_t, 8>());
+	else if (half.size() <= 16)
+		run(std::integral_constant<std::size_t, 16>());
+	else if (half.size() <= 32)
+		run(std::integral_constant<std::size_t, 32>());
+	else if (half.size() <= 64)
+		run(std::integral_constant<std::size_t, 64>());
+	else
+		throw InternalException(
+		    "Neighbourhood too large! (at most 128 neighbours)");
+}
+
+// i3d::Neighbourhood of the voxels of a structuring element
+inline Neighbourhood to_neighbourhood(const ::se::StructuringElement& se) {
+	Neighbourhood neighbourhood;
+	se.GetNeighbours(neighbourhood.offset);
+	return neighbourhood;
+}
+
+// Dense ranks of the distinct values of marker and mask. 8 and 16 bit
+// integers index a table of all their values, wider types an open addressing
+// hash table keyed by the bit pattern.
+template <typename img_t>
+struct rank_map {
+	static constexpr bool table_lookup =
+	    std::is_integral_v<img_t> && sizeof(img_t) <= 2;
+
+	// distinct values in increasing order
+	std::vector<img_t> values;
+	// rank + 1 of the value of every slot, 0 for a free one
+	std::vector<std::uint32_t> ranks;
+	// value of every slot of the hash table
+	std::vector<img_t> keys;
+	int shift = 0;
+
+	std::size_t slot(img_t v) const {
+		if constexpr (table_lookup) {
+			return std::make_unsigned_t<img_t>(v);
+		} else {
+			std::uint64_t bits = 0;
+			std::memcpy(&bits, &v, sizeof(img_t));
+			std::size_t s =
+			    std::size_t((bits * 0x9e3779b97f4a7c15ull) >> shift);
+			while (ranks[s] != 0 && keys[s] != v)
+				s = (s + 1) & (ranks.size() - 1);
+			return s;
+		}
+	}
+
+	// false if marker and mask have more than limit distinct values, or a NaN
+	bool build(const Image3d<img_t>& marker,
+	           const Image3d<img_t>& mask,
+	           std::size_t limit) {
+		const img_t* images[2] = {marker.GetFirstVoxelAddr(),
+		                          mask.GetFirstVoxelAddr()};
+		const std::size_t voxels = marker.GetImageSize();
+		if constexpr (table_lookup) {
+			ranks.assign(std::size_t(1) << (8 * sizeof(img_t)), 0);
+			for (const img_t* data : images)
+				for (std::size_t i = 0; i < voxels; ++i)
+					ranks[slot(data[i])] = 1;
+			for (img_t v = lowest<img_t>();; ++v) {
+				if (ranks[slot(v)] != 0)
+					values.push_back(v);
+				if (v == highest<img_t>())
+					break;
+			}
+			if (values.size() > limit)
+				return false;
+		} else {
+			// at most half full
+			int bits = std::bit_width(2 * limit - 1);
+			shift = 64 - bits;
+			ranks.assign(std::size_t(1) << bits, 0);
+			keys.resize(ranks.size());
+			for (const img_t* data : images)
+				for (std::size_t i = 0; i < voxels; ++i) {
+					img_t v = data[i];
+					if (v != v)
+						return false;
+					std::size_t s = slot(v);
+					if (ranks[s] == 0) {
+						if (values.size() == limit)
+							return false;
+						ranks[s] = 1;
+						keys[s] = v;
+						values.push_back(v);
+					}
+				}
+			std::sort(values.begin(), values.end());
+		}
+		for (std::size_t r = 0; r < values.size(); ++r)
+			ranks[slot(values[r])] = std::uint32_t(r + 1);
+		return true;
+	}
+
+	template <typename rank_t>
+	void to_ranks(const Image3d<img_t>& image, Image3d<rank_t>& out) const {
+		out.MakeRoom(image.GetSize());
+		const img_t* src = image.GetFirstVoxelAddr();
+		rank_t* dst = out.GetFirstVoxelAddr();
+		for (std::size_t i = 0; i < image.GetImageSize(); ++i)
+			dst[i] = rank_t(ranks[slot(src[i])] - 1);
+	}
+
+	template <typename rank_t>
+	void from_ranks(const Image3d<rank_t>& image, Image3d<img_t>& out) const {
+		const rank_t* src = image.GetFirstVoxelAddr();
+		img_t* dst = out.GetFirstVoxelAddr();
+		for (std::size_t i = 0; i < image.GetImageSize(); ++i)
+			dst[i] = values[src[i]];
+	}
+};
+
+// Reconstruction commutes with strictly increasing maps of the values, so it
+// can run on the ranks of the values of marker and mask in a narrower type:
+// 8 bits for at most 256 distinct values, 16 bits for at most 65536 of them
+// if img_t is wider. Returns false, leaving marker untouched, if the values
+// do not fit.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          typename adjacency_t>
+bool reconstruction_on_ranks(Image3d<img_t>& marker,
+                             const Image3d<img_t>& mask,
+                             neigh_f neighbour_fun,
+                             mask_f mask_fun,
+                             const adjacency_t& adjacency,
+                             const options& options_,
+                             budget* budget_) {
+	constexpr bool order_based =
+	    (std::is_same_v<neigh_f, max_fun> && std::is_same_v<mask_f, min_fun>) ||
+	    (std::is_same_v<neigh_f, min_fun> && std::is_same_v<mask_f, max_fun>);
+	if constexpr (!order_based || std::is_same_v<img_t, bool> ||
+	              sizeof(img_t) < 2) {
+		return false;
+	} else {
+		rank_map<img_t> map;
+		if (!map.build(marker, mask,
+		               sizeof(img_t) > 2 ? std::size_t(1) << 16 : 1 << 8))
+			return false;
+
+		auto run = [&](auto rank) {
+			using rank_t = decltype(rank);
+			Image3d<rank_t> marker_ranks, mask_ranks;
+			map.to_ranks(marker, marker_ranks);
+			map.to_ranks(mask, mask_ranks);
+			with_neighbourhood(
+			    marker.GetSize(), adjacency,
+			    [&](const auto& forward_neigh, const auto& backward_neigh) {
+				    fast_morphology::reconstruction_engine(
+				        marker_ranks, mask_ranks, neighbour_fun, mask_fun,
+				        forward_neigh, backward_neigh, options_, budget_);
+			    });
+			map.from_ranks(marker_ranks, marker);
+		};
+		if (map.values.size() <= 256)
+			run(std::uint8_t{});
+		else
+			run(std::uint16_t{});
+		return true;
+	}
+}
+} // namespace details
+
+// Reconstruction with the cell adjacency or the i3d::Neighbourhood
+// adjacency. Returns false if stopped by a limit of options_ before
+// converging.
+template <typename img_t,
+          typename neigh_f,
+          typename mask_f,
+          typename adjacency_t>
+bool reconstruction(Image3d<img_t>& marker,
+                    const Image3d<img_t>& mask,
+                    neigh_f neighbour_fun,
+                    mask_f mask_fun,
+                    const adjacency_t& adjacency,
+                    const options& options_ = {}) {
+	details::stats_timer timer(options_.stats);
+	std::optional<details::budget> limits;
+	if (details::budget::limits(options_))
+		limits.emplace(options_);
+	details::budget* budget_ = limits ? &*limits : nullptr;
+
+	if (!options_.rank_compress ||
+	    !details::reconstruction_on_ranks(marker, mask, neighbour_fun,
+	                                      mask_fun, adjacency, options_,
+	                                      budget_))
+		details::with_neighbourhood(
+		    marker.GetSize(), adjacency,
+		    [&](const auto& forward_neigh, const auto& backward_neigh) {
+			    fast_morphology::reconstruction_engine(
+			        marker, mask, neighbour_fun, mask_fun, forward_neigh,
+			        backward_neigh, options_, budget_);
+		    });
+	if (budget_ == nullptr || !budget_->stopped)
+		return true;
+	// the voxels not reached by the first pass may still lie beyond the mask
+	img_t* data = marker.GetFirstVoxelAddr();
+	const img_t* mask_data = mask.GetFirstVoxelAddr();
+	for (std::size_t i = 0; i < marker.GetImageSize(); ++i)
+		data[i] = mask_fun(data[i], mask_data[i]);
+	return false;
+}
+
+namespace details {
+// Brings data, the reconstruction of a marker and a mask that differed from
+// marker_data and mask_data in the voxels of changed only, up to date.
+// changed holds the index and the previous marker value of those voxels in
+// increasing index order.
+// Voxels that lost their support, because the marker of a voxel holding its
+// own value was lowered or the mask dropped below the result, are reset to
+// the clamped marker together with every voxel that may have taken its value
+// from a reset one. The changed and the reset voxels and their neighbours
+// are then propagated from by a FIFO as in the hybrid algorithm. Gives up,
+// returning false with data partly updated, after processing budget queued
+// voxels.
+template <typename img_t, typename neigh_f, typename mask_f, std::size_t N>
+bool update_changed(img_t* data,
+                    const img_t* marker_data,
+                    const img_t* mask_data,
+                    neigh_f neighbour_fun,
+                    mask_f mask_fun,
+                    const linear_neighbourhood<N>& all,
+                    const std::vector<std::pair<std::size_t, img_t>>& changed,
+                    std::size_t budget) {
+	const Vector3d<int> size = all.size;
+	const std::size_t slice = std::size_t(size.x) * size.y;
+	auto for_each_neighbour = [&](std::size_t idx, auto fun) {
+		all.for_each(int(idx % size.x), int(idx % slice) / size.x,
+		             int(idx / slice), idx, fun);
+	};
+	auto clamped = [&](std::size_t idx) {
+		return mask_fun(marker_data[idx], mask_data[idx]);
+	};
+	// a is b or worse (not larger for dilation)
+	auto within = [&](img_t a, img_t b) { return neighbour_fun(a, b) == b; };
+
+	// ====== raise the changed voxels, collect the ones that lost support
+	std::queue<std::pair<std::size_t, img_t>> lost;
+	for (auto [idx, old_marker] : changed) {
+		img_t val = data[idx], base = clamped(idx);
+		bool above_mask = mask_fun(val, mask_data[idx]) != val;
+		bool lowered =
+		    within(val, old_marker) && base != val && within(base, val);
+		if (above_mask || lowered) {
+			lost.emplace(idx, val);
+			data[idx] = base;
+		} else {
+			data[idx] = neighbour_fun(val, base);
+		}
+	}
+
+	// q may have taken its value from a neighbour of value val; the mask of a
+	// changed voxel may have been different then
+	auto may_depend = [&](std::size_t q, img_t val) {
+		if (data[q] == mask_fun(val, mask_data[q]))
+			return true;
+		auto it = std::lower_bound(
+		    changed.begin(), changed.end(), q,
+		    [](const auto& entry, std::size_t i) { return entry.first < i; });
+		return it != changed.end() && it->first == q && within(data[q], val);
+	};
+
+	// ====== reset every voxel a lost value could have reached
+	std::vector<std::size_t> reset;
+	std::size_t queued = 0;
+	while (!lost.empty()) {
+		if (++queued > budget)
+			return false;
+		auto [idx, old_val] = lost.front();
+		lost.pop();
+		reset.push_back(idx);
+		for_each_neighbour(idx, [&](std::size_t q) {
+			img_t base = clamped(q);
+			if (data[q] != base && may_depend(q, old_val)) {
+				lost.emplace(q, data[q]);
+				data[q] = base;
+			}
+		});
+	}
+
+	// ====== propagation
+	auto propagated = [&](std::size_t q, img_t p_val) {
+		return mask_fun(neighbour_fun(data[q], p_val), mask_data[q]);
+	};
+	std::queue<std::size_t> fifo;
+	auto seed = [&](std::size_t idx) {
+		fifo.push(idx);
+		for_each_neighbour(idx, [&](std::size_t q) { fifo.push(q); });
+	};
+	for (auto [idx, old_marker] : changed)
+		seed(idx);
+	for (std::size_t idx : reset)
+		seed(idx);
+	while (!fifo.empty()) {
+		if (++queued > budget)
+			return false;
+		std::size_t idx = fifo.front();
+		fifo.pop();
+		img_t val = data[idx];
+		for_each_neighbour(idx, [&](std::size_t q) {
+			img_t new_val = propagated(q, val);
+			if (new_val != data[q]) {
+				data[q] = new_val;
+				fifo.push(q);
+			}
+		});
+	}
+	return true;
+}
+
+// Fill-hole marker: the input on the image border, the largest value inside;
+// axes of extent 1 have no border.
+template <typename img_t>
+void fillhole_marker(const Image3d<img_t>& in, Image3d<img_t>& out) {
+	Vector3d<int> size = in.GetSize();
+	out.CopyMetaData(in);
+	const img_t* src = in.GetFirstVoxelAddr();
+	img_t* dst = out.GetFirstVoxelAddr();
+	auto inner = [](int c, int extent) {
+		return extent == 1 || (0 < c && c < extent - 1);
+	};
+	for (int z = 0; z < size.z; ++z)
+		for (int y = 0; y < size.y; ++y) {
+			std::size_t row = (std::size_t(z) * size.y + y) * size.x;
+			if (!inner(y, size.y) || !inner(z, size.z)) {
+				std::copy_n(src + row, size.x, dst + row);
+				continue;
+			}
+			for (int x = 0; x < size.x; ++x)
+				dst[row + x] =
+				    inner(x, size.x) ? highest<img_t>() : src[row + x];
+		}
+}
+
+// Turns marker and result, the fill-hole marker and result of previous, into
+// those of current by propagating from the voxels that differ between the
+// two frames only. Returns false if that is not worth it: a single voxel,
+// more than 1/16 of the voxels changed or the update reaches more than 1/8
+// of them. marker and result have to be rebuilt then.
+template <typename img_t>
+bool fillhole_warm_start(const Image3d<img_t>& previous,
+                         const Image3d<img_t>& current,
+                         Image3d<img_t>& marker,
+                         Image3d<img_t>& result,
+                         int cell_adjacency) {
+	const std::size_t voxels = current.GetImageSize();
+	if (voxels == 1)
+		return false;
+	const img_t* previous_data = previous.GetFirstVoxelAddr();
+	const img_t* current_data = current.GetFirstVoxelAddr();
+	std::vector<std::pair<std::size_t, img_t>> changed;
+	for (std::size_t i = 0; i < voxels; ++i)
+		if (previous_data[i] != current_data[i]) {
+			if (changed.size() == voxels / 16)
+				return false;
+			changed.emplace_back(i, marker.GetVoxel(i));
+		}
+
+	for (auto [idx, old_marker] : changed) {
+		Vector3d<int> c = current.GetPos(idx);
+		if (current.OnBorder(c.x, c.y, c.z))
+			marker.SetVoxel(idx, current_data[idx]);
+	}
+	const Vector3d<int> size = current.GetSize();
+	bool done = false;
+	with_neighbourhood(
+	    size, cell_adjacency,
+	    [&](const auto& forward_neigh, const auto& backward_neigh) {
+		    done = update_changed(
+		        result.GetFirstVoxelAddr(), marker.GetFirstVoxelAddr(),
+		        current_data, min_fun{}, max_fun{},
+		        linear_neighbourhood(concat_arrays(to_3d(forward_neigh),
+		                                           to_3d(backward_neigh)),
+		                             size),
+		        changed, voxels / 8);
+	    });
+	return done;
+}
+} // namespace details
+
+// Brings result, the reconstruction of marker and mask as they were before
+// an edit inside voi, up to date: marker_patch (of voi.size) is written to
+// the marker, the mask may already have been changed inside voi.
+template <typename img_t, typename neigh_f, typename mask_f>
+void reconstruction_update(Image3d<img_t>& marker,
+                           const Image3d<img_t>& mask,
+                           Image3d<img_t>& result,
+                           const VOI<PIXELS>& voi,
+                           const Image3d<img_t>& marker_patch,
+                           neigh_f neighbour_fun,
+                           mask_f mask_fun,
+                           int cell_adjacency,
+                           const options& options_) {
+	details::stats_timer timer(options_.stats);
+	if (marker.GetSize() != mask.GetSize() ||
+	    result.GetSize() != mask.GetSize())
+		throw InternalException(
+		    "Mask, marker and result must be the same size");
+	if (marker_patch.GetSize() != voi.size)
+		throw InternalException("The marker patch must be of the VOI size");
+	if (voi.Size() == 0)
+		return;
+	const Vector3d<int> last =
+	    voi.offset + Vector3d<int>(voi.size) - Vector3d<int>(1, 1, 1);
+	if (voi.offset.x < 0 || voi.offset.y < 0 || voi.offset.z < 0 ||
+	    !marker.Include(last.x, last.y, last.z))
+		throw InternalException("The VOI must lie inside the image");
+
+	const Vector3d<int> size = marker.GetSize();
+	const Vector3d<int> begin = voi.offset;
+	const Vector3d<int> end = voi.offset + Vector3d<int>(voi.size);
+	img_t* marker_data = marker.GetFirstVoxelAddr();
+	const img_t* patch_data = marker_patch.GetFirstVoxelAddr();
+	std::vector<std::pair<std::size_t, img_t>> changed;
+	changed.reserve(voi.Size());
+	for (int z = begin.z; z < end.z; ++z)
+		for (int y = begin.y; y < end.y; ++y)
+			for (int x = begin.x; x < end.x; ++x) {
+				std::size_t idx = (std::size_t(z) * size.y + y) * size.x + x;
+				changed.emplace_back(idx, marker_data[idx]);
+				marker_data[idx] = *patch_data++;
+			}
+
+	if (marker.GetImageSize() == 1) {
+		result.SetVoxel(0, mask_fun(marker.GetVoxel(0), mask.GetVoxel(0)));
+		return;
+	}
+	// an update reaching more than 1/8 of the image is left to the engines
+	bool done = false;
+	details::with_neighbourhood(
+	    size, cell_adjacency,
+	    [&](const auto& forward_neigh, const auto& backward_neigh) {
+		    done = details::update_changed(
+		        result.GetFirstVoxelAddr(), marker_data,
+		        mask.GetFirstVoxelAddr(), neighbour_fun, mask_fun,
+		        details::linear_neighbourhood(
+		            details::concat_arrays(details::to_3d(forward_neigh),
+		                                   details::to_3d(backward_neigh)),
+		            size),
+		        changed, marker.GetImageSize() / 8);
+	    });
+	if (!done) {
+		result = marker;
+		fast_morphology::reconstruction(result, mask, neighbour_fun, mask_fun,
+		                                cell_adjacency,
+		                                details::without_limits(options_));
 	}
 }
 
 } // namespace fast_morphology
 
 template <typename img_t>
-void Reconstruction_by_dilation_fast(const i3d::Image3d<img_t>& marker,
+bool Reconstruction_by_dilation_fast(i3d::Image3d<img_t>& marker,
                                      const i3d::Image3d<img_t>& mask,
-                                     i3d::Image3d<img_t>& out,
-                                     int cell_adjacency /* = 0 */) {
+                                     int cell_adjacency /* = 0 */,
+                                     const fast_morphology::options& options_
+                                     /* = {} */) {
+	if (marker.GetSize() != mask.GetSize())
+		throw InternalException("Mask and marker must be the same size");
+
+	return fast_morphology::reconstruction(
+	    marker, mask, fast_morphology::details::max_fun{},
+	    fast_morphology::details::min_fun{}, cell_adjacency, options_);
+}
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(i3d::Image3d<img_t>& marker,
+                                    const i3d::Image3d<img_t>& mask,
+                                    int cell_adjacency /* = 0 */,
+                                    const fast_morphology::options& options_
+                                    /* = {} */) {
 	if (marker.GetSize() != mask.GetSize())
 		throw InternalException("Mask and marker must be the same size");
-	out = marker;
 
-	fast_morphology::reconstruction(
-	    out, mask, [](img_t a, img_t b) { return std::max(a, b); },
-	    [](img_t a, img_t b) { return std::min(a, b); }, cell_adjacency);
+	return fast_morphology::reconstruction(
+	    marker, mask, fast_morphology::details::min_fun{},
+	    fast_morphology::details::max_fun{}, cell_adjacency, options_);
+}
+
+template <typename img_t>
+bool Reconstruction_by_dilation_fast(const i3d::Image3d<img_t>& marker,
+                                     const i3d::Image3d<img_t>& mask,
+                                     i3d::Image3d<img_t>& out,
+                                     int cell_adjacency /* = 0 */,
+                                     const fast_morphology::options& options_
+                                     /* = {} */) {
+	if (&out == &mask) {
+		i3d::Image3d<img_t> mask_copy = mask;
+		return Reconstruction_by_dilation_fast(marker, mask_copy, out,
+		                                       cell_adjacency, options_);
+	}
+	if (&out != &marker)
+		out = marker;
+	return Reconstruction_by_dilation_fast(out, mask, cell_adjacency, options_);
 }
 
 template <typename img_t>
-void Reconstruction_by_erosion_fast(const i3d::Image3d<img_t>& marker,
+bool Reconstruction_by_erosion_fast(const i3d::Image3d<img_t>& marker,
                                     const i3d::Image3d<img_t>& mask,
                                     i3d::Image3d<img_t>& out,
-                                    int cell_adjacency /* = 0 */) {
+                                    int cell_adjacency /* = 0 */,
+                                    const fast_morphology::options& options_
+                                    /* = {} */) {
+	if (&out == &mask) {
+		i3d::Image3d<img_t> mask_copy = mask;
+		return Reconstruction_by_erosion_fast(marker, mask_copy, out,
+		                                      cell_adjacency, options_);
+	}
+	if (&out != &marker)
+		out = marker;
+	return Reconstruction_by_erosion_fast(out, mask, cell_adjacency, options_);
+}
+
+template <typename img_t>
+bool Reconstruction_by_dilation_fast(i3d::Image3d<img_t>& marker,
+                                     const i3d::Image3d<img_t>& mask,
+                                     const i3d::Neighbourhood& neighbourhood,
+                                     const fast_morphology::options& options_
+                                     /* = {} */) {
+	if (marker.GetSize() != mask.GetSize())
+		throw InternalException("Mask and marker must be the same size");
+
+	return fast_morphology::reconstruction(
+	    marker, mask, fast_morphology::details::max_fun{},
+	    fast_morphology::details::min_fun{}, neighbourhood, options_);
+}
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(i3d::Image3d<img_t>& marker,
+                                    const i3d::Image3d<img_t>& mask,
+                                    const i3d::Neighbourhood& neighbourhood,
+                                    const fast_morphology::options& options_
+                                    /* = {} */) {
 	if (marker.GetSize() != mask.GetSize())
 		throw InternalException("Mask and marker must be the same size");
-	out = marker;
 
-	fast_morphology::reconstruction(
-	    out, mask, [](img_t a, img_t b) { return std::min(a, b); },
-	    [](img_t a, img_t b) { return std::max(a, b); }, cell_adjacency);
+	return fast_morphology::reconstruction(
+	    marker, mask, fast_morphology::details::min_fun{},
+	    fast_morphology::details::max_fun{}, neighbourhood, options_);
+}
+
+template <typename img_t>
+bool Reconstruction_by_dilation_fast(const i3d::Image3d<img_t>& marker,
+                                     const i3d::Image3d<img_t>& mask,
+                                     i3d::Image3d<img_t>& out,
+                                     const i3d::Neighbourhood& neighbourhood,
+                                     const fast_morphology::options& options_
+                                     /* = {} */) {
+	if (&out == &mask) {
+		i3d::Image3d<img_t> mask_copy = mask;
+		return Reconstruction_by_dilation_fast(marker, mask_copy, out,
+		                                       neighbourhood, options_);
+	}
+	if (&out != &marker)
+		out = marker;
+	return Reconstruction_by_dilation_fast(out, mask, neighbourhood, options_);
+}
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(const i3d::Image3d<img_t>& marker,
+                                    const i3d::Image3d<img_t>& mask,
+                                    i3d::Image3d<img_t>& out,
+                                    const i3d::Neighbourhood& neighbourhood,
+                                    const fast_morphology::options& options_
+                                    /* = {} */) {
+	if (&out == &mask) {
+		i3d::Image3d<img_t> mask_copy = mask;
+		return Reconstruction_by_erosion_fast(marker, mask_copy, out,
+		                                      neighbourhood, options_);
+	}
+	if (&out != &marker)
+		out = marker;
+	return Reconstruction_by_erosion_fast(out, mask, neighbourhood, options_);
+}
+
+template <typename img_t>
+bool Reconstruction_by_dilation_fast(i3d::Image3d<img_t>& marker,
+                                     const i3d::Image3d<img_t>& mask,
+                                     const se::StructuringElement& se,
+                                     const fast_morphology::options& options_
+                                     /* = {} */) {
+	return Reconstruction_by_dilation_fast(
+	    marker, mask, fast_morphology::details::to_neighbourhood(se),
+	    options_);
+}
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(i3d::Image3d<img_t>& marker,
+                                    const i3d::Image3d<img_t>& mask,
+                                    const se::StructuringElement& se,
+                                    const fast_morphology::options& options_
+                                    /* = {} */) {
+	return Reconstruction_by_erosion_fast(
+	    marker, mask, fast_morphology::details::to_neighbourhood(se),
+	    options_);
+}
+
+template <typename img_t>
+bool Reconstruction_by_dilation_fast(const i3d::Image3d<img_t>& marker,
+                                     const i3d::Image3d<img_t>& mask,
+                                     i3d::Image3d<img_t>& out,
+                                     const se::StructuringElement& se,
+                                     const fast_morphology::options& options_
+                                     /* = {} */) {
+	return Reconstruction_by_dilation_fast(
+	    marker, mask, out, fast_morphology::details::to_neighbourhood(se),
+	    options_);
+}
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(const i3d::Image3d<img_t>& marker,
+                                    const i3d::Image3d<img_t>& mask,
+                                    i3d::Image3d<img_t>& out,
+                                    const se::StructuringElement& se,
+                                    const fast_morphology::options& options_
+                                    /* = {} */) {
+	return Reconstruction_by_erosion_fast(
+	    marker, mask, out, fast_morphology::details::to_neighbourhood(se),
+	    options_);
+}
+
+template <typename img_t>
+void Reconstruction_by_dilation_fast_update(
+    i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    i3d::Image3d<img_t>& out,
+    const i3d::VOI<i3d::PIXELS>& voi,
+    const i3d::Image3d<img_t>& marker_patch,
+    int cell_adjacency /* = 0 */,
+    const fast_morphology::options& options_ /* = {} */) {
+	fast_morphology::reconstruction_update(
+	    marker, mask, out, voi, marker_patch,
+	    fast_morphology::details::max_fun{},
+	    fast_morphology::details::min_fun{}, cell_adjacency, options_);
+}
+
+template <typename img_t>
+void Reconstruction_by_erosion_fast_update(
+    i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    i3d::Image3d<img_t>& out,
+    const i3d::VOI<i3d::PIXELS>& voi,
+    const i3d::Image3d<img_t>& marker_patch,
+    int cell_adjacency /* = 0 */,
+    const fast_morphology::options& options_ /* = {} */) {
+	fast_morphology::reconstruction_update(
+	    marker, mask, out, voi, marker_patch,
+	    fast_morphology::details::min_fun{},
+	    fast_morphology::details::max_fun{}, cell_adjacency, options_);
+}
+
+template <typename img_t>
+bool Fillhole_fast(const i3d::Image3d<img_t>& in,
+                   i3d::Image3d<img_t>& out,
+                   int cell_adjacency /* = 0 */,
+                   const fast_morphology::options& options_ /* = {} */) {
+	if (&out == &in) {
+		i3d::Image3d<img_t> mask = in;
+		return Fillhole_fast(mask, out, cell_adjacency, options_);
+	}
+
+	if (in.GetImageSize() == 1) {
+		out = in;
+		return true;
+	}
+	fast_morphology::details::fillhole_marker(in, out);
+	return Reconstruction_by_erosion_fast(out, in, cell_adjacency, options_);
+}
+
+template <typename img_t, typename load_f, typename store_f>
+void Fillhole_fast_series(std::size_t frames,
+                          load_f load,
+                          store_f store,
+                          int cell_adjacency /* = 0 */,
+                          const fast_morphology::options& options_
+                          /* = {} */) {
+	// frames t - 1, t and t + 1 rotate through the buffers
+	i3d::Image3d<img_t> buffers[3];
+	i3d::Image3d<img_t> marker, result;
+	if (frames > 0)
+		load(std::size_t(0), buffers[0]);
+	for (std::size_t t = 0; t < frames; ++t) {
+		const i3d::Image3d<img_t>& current = buffers[t % 3];
+		const i3d::Image3d<img_t>& previous = buffers[(t + 2) % 3];
+		std::exception_ptr load_error;
+		{
+			// frame t + 1 is loaded while frame t is computed
+			std::jthread loader;
+			if (t + 1 < frames)
+				loader = std::jthread([&] {
+					try {
+						load(t + 1, buffers[(t + 1) % 3]);
+					} catch (...) {
+						load_error = std::current_exception();
+					}
+				});
+			if (t > 0 && current.GetSize() != previous.GetSize())
+				throw InternalException(
+				    "All frames of the series must be the same size");
+			fast_morphology::details::stats_timer timer(options_.stats);
+			if (t == 0 || !fast_morphology::details::fillhole_warm_start(
+			                  previous, current, marker, result,
+			                  cell_adjacency)) {
+				Fillhole_fast(current, result, cell_adjacency,
+				              fast_morphology::details::without_limits(
+				                  options_));
+				fast_morphology::details::fillhole_marker(current, marker);
+			}
+			store(t, static_cast<const i3d::Image3d<img_t>&>(result));
+		}
+		if (load_error)
+			std::rethrow_exception(load_error);
+	}
+}
+
+template <typename img_t>
+void Fillhole_fast_series(const std::vector<i3d::Image3d<img_t>>& in,
+                          std::vector<i3d::Image3d<img_t>>& out,
+                          int cell_adjacency /* = 0 */,
+                          const fast_morphology::options& options_
+                          /* = {} */) {
+	out.resize(in.size());
+	Fillhole_fast_series<img_t>(
+	    in.size(),
+	    [&](std::size_t t, i3d::Image3d<img_t>& frame) { frame = in[t]; },
+	    [&](std::size_t t, const i3d::Image3d<img_t>& result) {
+		    out[t] = result;
+	    },
+	    cell_adjacency, options_);
 }
 } // namespace i3d
\ No newline at end of file
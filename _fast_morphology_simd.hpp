@@ -0,0 +1,274 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+// Vectorised row kernel of the raster passes built on GCC/Clang vector
+// extensions. The widest instruction set available is picked at runtime, so
+// the binary itself only requires the baseline of the target architecture.
+// Other compilers use the scalar kernel only.
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 12)
+#define I3D_FAST_MORPHOLOGY_SIMD 1
+#endif
+
+namespace i3d {
+namespace fast_morphology {
+namespace details {
+// smallest / largest value of T (neutral elements of max / min)
+template <typename T>
+constexpr T lowest() {
+	if constexpr (std::numeric_limits<T>::has_infinity)
+		return -std::numeric_limits<T>::infinity();
+	else
+		return std::numeric_limits<T>::lowest();
+}
+
+template <typename T>
+constexpr T highest() {
+	if constexpr (std::numeric_limits<T>::has_infinity)
+		return std::numeric_limits<T>::infinity();
+	else
+		return std::numeric_limits<T>::max();
+}
+
+// fun(0), fun(1), ..., fun(N - 1) unrolled, the neighbour loops of the
+// kernels have a trip count fixed by the neighbourhood
+template <std::size_t N, typename fun_t, std::size_t... I>
+inline void unroll(fun_t&& fun, std::index_sequence<I...>) {
+	(fun(I), ...);
+}
+
+template <std::size_t N, typename fun_t>
+inline void unroll(fun_t&& fun) {
+	unroll<N>(fun, std::make_index_sequence<N>());
+}
+
+#ifdef I3D_FAST_MORPHOLOGY_SIMD
+namespace simd {
+#define I3D_FM_INLINE inline __attribute__((always_inline))
+#define I3D_FM_INLINE_LAMBDA __attribute__((always_inline))
+
+template <typename T>
+constexpr bool has_row_kernel =
+    std::is_same_v<T, std::uint8_t> || std::is_same_v<T, std::uint16_t> ||
+    std::is_same_v<T, float>;
+
+template <typename T, std::size_t bytes>
+struct vec_traits {
+	typedef T vec __attribute__((vector_size(bytes)));
+	static constexpr int width = int(bytes / sizeof(T));
+};
+
+// Vectors are passed by reference only, so that the helpers instantiated
+// outside the target specific kernels do not depend on the vector ABI.
+
+// a = nf(a, b) with the neighbour function (max for dilation)
+template <bool dilation, typename vec>
+I3D_FM_INLINE void apply_nf(vec& a, const vec& b) {
+	if constexpr (dilation)
+		a = a < b ? b : a;
+	else
+		a = b < a ? b : a;
+}
+
+// a = mf(a, b) with the mask function (min for dilation)
+template <bool dilation, typename vec>
+I3D_FM_INLINE void apply_mf(vec& a, const vec& b) {
+	apply_nf<!dilation>(a, b);
+}
+
+// out lane i <- a lane i - k (up) or lane i + k (down), vacated lanes from
+// fill
+template <int k, bool up, typename vec, std::size_t... I>
+I3D_FM_INLINE void
+shift(vec& out, const vec& a, const vec& fill, std::index_sequence<I...>) {
+	constexpr int w = int(sizeof...(I));
+	if constexpr (up)
+		out = __builtin_shufflevector(
+		    a, fill, (int(I) >= k ? int(I) - k : int(I) + w)...);
+	else
+		out = __builtin_shufflevector(
+		    a, fill, (int(I) + k < w ? int(I) + k : int(I) + w)...);
+}
+
+// Inclusive scan of the clamp functions f_i(p) = nf(v_i, mf(p, m_i)) in
+// processing order (increasing lanes when forward). After the scan lane i
+// holds (v, m) of the composition of all functions up to lane i.
+template <int k, bool forward, bool dilation, int width, typename vec>
+I3D_FM_INLINE void scan(vec& v, vec& m, const vec& v_fill, const vec& m_fill) {
+	if constexpr (k < width) {
+		vec v_prev, m_prev;
+		shift<k, forward>(v_prev, v, v_fill, std::make_index_sequence<width>());
+		shift<k, forward>(m_prev, m, m_fill, std::make_index_sequence<width>());
+		apply_mf<dilation>(v_prev, m);
+		apply_nf<dilation>(v, v_prev);
+		apply_mf<dilation>(m, m_prev);
+		scan<k * 2, forward, dilation, width>(v, m, v_fill, m_fill);
+	}
+}
+
+// Updates len voxels starting at p whose only in-row neighbour is the
+// previously processed voxel (value carry). cross holds the offsets of the
+// remaining cross_count neighbours, all lying in already final rows. Returns
+// the number of changed voxels.
+template <typename T,
+          std::size_t bytes,
+          bool forward,
+          bool dilation,
+          std::size_t cross_count>
+I3D_FM_INLINE std::size_t row_kernel(T* p,
+                                     const T* mask,
+                                     const std::ptrdiff_t* cross,
+                                     std::size_t len,
+                                     T carry) {
+	using vec = typename vec_traits<T, bytes>::vec;
+	using cmp = decltype(vec{} != vec{});
+	using cmp_lane = std::remove_cvref_t<decltype(cmp{}[0])>;
+	constexpr int width = vec_traits<T, bytes>::width;
+	// per lane change counters are flushed before they can overflow
+	constexpr std::size_t flush_every = std::numeric_limits<cmp_lane>::max();
+
+	const T nf_neutral = dilation ? lowest<T>() : highest<T>();
+	const T mf_neutral = dilation ? highest<T>() : lowest<T>();
+	const vec v_fill = vec{} + nf_neutral;
+	const vec m_fill = vec{} + mf_neutral;
+
+	std::size_t changed = 0;
+	cmp changed_lanes = {};
+	std::size_t pending = 0;
+	auto flush = [&] {
+		// lanes of a true comparison are -1
+		for (int l = 0; l < width; ++l)
+			changed += std::size_t(-std::ptrdiff_t(changed_lanes[l]));
+		changed_lanes = cmp{};
+		pending = 0;
+	};
+
+	// kept inline whatever the number of neighbours
+	auto process_vector = [&](std::size_t i) I3D_FM_INLINE_LAMBDA {
+		vec center, val, m;
+		std::memcpy(&center, p + i, bytes);
+		std::memcpy(&m, mask + i, bytes);
+		val = center;
+		unroll<cross_count>([&](std::size_t c) I3D_FM_INLINE_LAMBDA {
+			vec n;
+			std::memcpy(&n, p + i + cross[c], bytes);
+			apply_nf<dilation>(val, n);
+		});
+		apply_mf<dilation>(val, m);
+		scan<1, forward, dilation, width>(val, m, v_fill, m_fill);
+		vec carried = vec{} + carry;
+		apply_mf<dilation>(carried, m);
+		apply_nf<dilation>(val, carried);
+		std::memcpy(p + i, &val, bytes);
+		carry = val[forward ? width - 1 : 0];
+		changed_lanes += (center != val);
+		if (++pending == flush_every)
+			flush();
+	};
+
+	auto process_scalar = [&](std::size_t i) I3D_FM_INLINE_LAMBDA {
+		T center = p[i];
+		T val = center;
+		unroll<cross_count>([&](std::size_t c) I3D_FM_INLINE_LAMBDA {
+			val = dilation ? std::max(p[i + cross[c]], val)
+			               : std::min(p[i + cross[c]], val);
+		});
+		val = dilation ? std::max(val, carry) : std::min(val, carry);
+		val = dilation ? std::min(val, mask[i]) : std::max(val, mask[i]);
+		p[i] = val;
+		carry = val;
+		changed += (center != val);
+	};
+
+	if constexpr (forward) {
+		std::size_t i = 0;
+		for (; i + width <= len; i += width)
+			process_vector(i);
+		for (; i < len; ++i)
+			process_scalar(i);
+	} else {
+		std::size_t i = len;
+		for (; i >= std::size_t(width); i -= width)
+			process_vector(i - width);
+		while (i > 0)
+			process_scalar(--i);
+	}
+	flush();
+	return changed;
+}
+
+template <typename T>
+using row_fn =
+    std::size_t (*)(T*, const T*, const std::ptrdiff_t*, std::size_t, T);
+
+// One kernel per voxel type, direction, polarity and number of neighbours in
+// other rows (dimension and adjacency) for every instruction set.
+template <typename T, bool forward, bool dilation, std::size_t cross_count>
+std::size_t row_baseline(T* p,
+                         const T* mask,
+                         const std::ptrdiff_t* cross,
+                         std::size_t len,
+                         T carry) {
+	return row_kernel<T, 16, forward, dilation, cross_count>(p, mask, cross,
+	                                                         len, carry);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <typename T, bool forward, bool dilation, std::size_t cross_count>
+__attribute__((target("avx2"))) std::size_t
+row_avx2(T* p,
+         const T* mask,
+         const std::ptrdiff_t* cross,
+         std::size_t len,
+         T carry) {
+	return row_kernel<T, 32, forward, dilation, cross_count>(p, mask, cross,
+	                                                         len, carry);
+}
+
+template <typename T, bool forward, bool dilation, std::size_t cross_count>
+__attribute__((target("avx512f,avx512bw"))) std::size_t
+row_avx512(T* p,
+           const T* mask,
+           const std::ptrdiff_t* cross,
+           std::size_t len,
+           T carry) {
+	return row_kernel<T, 64, forward, dilation, cross_count>(p, mask, cross,
+	                                                         len, carry);
+}
+#endif
+
+template <typename T, bool forward, bool dilation, std::size_t cross_count>
+row_fn<T> select_row_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw"))
+		return row_avx512<T, forward, dilation, cross_count>;
+	if (__builtin_cpu_supports("avx2"))
+		return row_avx2<T, forward, dilation, cross_count>;
+#endif
+	return row_baseline<T, forward, dilation, cross_count>;
+}
+
+template <bool forward, bool dilation, std::size_t cross_count, typename T>
+std::size_t row(T* p,
+                const T* mask,
+                const std::ptrdiff_t* cross,
+                std::size_t len,
+                T carry) {
+	static const row_fn<T> kernel =
+	    select_row_kernel<T, forward, dilation, cross_count>();
+	return kernel(p, mask, cross, len, carry);
+}
+
+#undef I3D_FM_INLINE
+#undef I3D_FM_INLINE_LAMBDA
+} // namespace simd
+#endif
+} // namespace details
+} // namespace fast_morphology
+} // namespace i3d
@@ -0,0 +1,416 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <i3d/image3d.h>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "fast_morphology.hpp"
+
+namespace {
+using fm_clock = std::chrono::steady_clock;
+
+template <typename fun_t>
+double measure(fun_t fun) {
+	auto start = fm_clock::now();
+	fun();
+	return std::chrono::duration<double>(fm_clock::now() - start).count();
+}
+
+void report(const std::string& name, double seconds, std::size_t voxels) {
+	std::printf("%-32s %10.3f s %10.3f ns/voxel\n", name.c_str(), seconds,
+	            seconds * 1e9 / double(voxels));
+}
+
+// Cellular mask with closed shells (holes to fill) and a little noise.
+i3d::Image3d<i3d::GRAY16> make_mask(std::size_t size) {
+	i3d::Image3d<i3d::GRAY16> mask;
+	mask.MakeRoom(size, size, size);
+	unsigned seed = 12345;
+	for (std::size_t z = 0; z < size; ++z)
+		for (std::size_t y = 0; y < size; ++y)
+			for (std::size_t x = 0; x < size; ++x) {
+				seed = seed * 1103515245u + 12345u;
+				bool wall = x % 32 < 2 || y % 32 < 2 || z % 32 < 2;
+				mask.SetVoxel(x, y, z,
+				              i3d::GRAY16((wall ? 3000 : 500) + (seed >> 24)));
+			}
+	return mask;
+}
+
+// Fill-hole marker as built in main.cpp.
+i3d::Image3d<i3d::GRAY16> make_marker(const i3d::Image3d<i3d::GRAY16>& mask) {
+	i3d::Image3d<i3d::GRAY16> marker = mask;
+	i3d::Vector3d<std::size_t> size = mask.GetSize();
+	for (std::size_t z = 1; z < size.z - 1; ++z)
+		for (std::size_t y = 1; y < size.y - 1; ++y)
+			for (std::size_t x = 1; x < size.x - 1; ++x)
+				marker.SetVoxel(x, y, z, 0);
+	return marker;
+}
+
+// Square spiral corridor (1000) winding inwards from (1, 1) between one
+// voxel thick walls (0), the same in every slice. Values seeded at the outer
+// end travel the whole corridor: about one turn per raster pass.
+i3d::Image3d<i3d::GRAY16> make_spiral(std::size_t size, std::size_t depth) {
+	i3d::Image3d<i3d::GRAY16> mask;
+	mask.MakeRoom(size, size, depth);
+	mask.SetAllVoxels(0);
+	const int dirs[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+	auto corridor = [&](int x, int y) {
+		return mask.GetVoxel(x, y, 0) != 0;
+	};
+	auto inside = [&](int x, int y) {
+		return 1 <= x && x < int(size) - 1 && 1 <= y && y < int(size) - 1;
+	};
+	// next step along d keeps a wall to the corridor already dug
+	auto can_step = [&](int x, int y, int d) {
+		int nx = x + dirs[d][0], ny = y + dirs[d][1];
+		return inside(nx, ny) && !corridor(nx, ny) &&
+		       !(inside(nx + dirs[d][0], ny + dirs[d][1]) &&
+		         corridor(nx + dirs[d][0], ny + dirs[d][1]));
+	};
+	int x = 1, y = 1, d = 0;
+	while (true) {
+		for (std::size_t z = 0; z < depth; ++z)
+			mask.SetVoxel(x, y, z, 1000);
+		if (!can_step(x, y, d)) {
+			d = (d + 1) % 4;
+			if (!can_step(x, y, d))
+				break;
+		}
+		x += dirs[d][0];
+		y += dirs[d][1];
+	}
+	return mask;
+}
+
+// Inner voxels of one forward pass written the way reconstruction_3d used to
+// do it: Image3d::GetVoxel/SetVoxel and tuple offsets.
+void getvoxel_forward_pass(i3d::Image3d<i3d::GRAY16>& marker,
+                           const i3d::Image3d<i3d::GRAY16>& mask) {
+	i3d::Vector3d<int> size = marker.GetSize();
+	for (int z = 1; z < size.z - 1; ++z)
+		for (int y = 1; y < size.y - 1; ++y)
+			for (int x = 1; x < size.x - 1; ++x) {
+				i3d::GRAY16 center = marker.GetVoxel(x, y, z);
+				i3d::GRAY16 val = center;
+				for (auto [dx, dy, dz] :
+				     i3d::fast_morphology::neighbour_diffs::forward_3d_2)
+					val = std::max(marker.GetVoxel(x + dx, y + dy, z + dz),
+					               val);
+				marker.SetVoxel(x, y, z, std::min(val, mask.GetVoxel(x, y, z)));
+			}
+}
+
+// Generic lambdas take the scalar kernel, the max/min functors of the
+// Reconstruction_by_*_fast functions the vectorised one.
+template <typename neigh_f, typename mask_f>
+void pointer_forward_pass(i3d::Image3d<i3d::GRAY16>& marker,
+                          const i3d::Image3d<i3d::GRAY16>& mask,
+                          neigh_f neighbour_fun,
+                          mask_f mask_fun) {
+	i3d::fast_morphology::details::linear_neighbourhood forward(
+	    i3d::fast_morphology::neighbour_diffs::forward_3d_2,
+	    i3d::Vector3d<int>(marker.GetSize()));
+	i3d::fast_morphology::details::sweep<true>(
+	    marker.GetFirstVoxelAddr(), mask.GetFirstVoxelAddr(), neighbour_fun,
+	    mask_fun, forward);
+}
+
+// Inner voxels of one forward pass with the neighbour offsets and the
+// max / min picked at runtime, as a kernel not specialised per neighbourhood,
+// voxel type and polarity would run.
+template <typename T>
+void generic_forward_pass(i3d::Image3d<T>& marker,
+                          const i3d::Image3d<T>& mask,
+                          const std::vector<std::tuple<int, int, int>>& neigh,
+                          bool dilation) {
+	typedef const T& (*fun_t)(const T&, const T&);
+	const fun_t max = std::max<T>, min = std::min<T>;
+	const fun_t neighbour_fun = dilation ? max : min;
+	const fun_t mask_fun = dilation ? min : max;
+	i3d::Vector3d<int> size = marker.GetSize();
+	std::vector<std::ptrdiff_t> offsets;
+	for (auto [dx, dy, dz] : neigh)
+		offsets.push_back(dx + std::ptrdiff_t(size.x) *
+		                           (dy + std::ptrdiff_t(size.y) * dz));
+	T* data = marker.GetFirstVoxelAddr();
+	const T* mask_data = mask.GetFirstVoxelAddr();
+	for (int z = 1; z < size.z - 1; ++z)
+		for (int y = 1; y < size.y - 1; ++y)
+			for (int x = 1; x < size.x - 1; ++x) {
+				std::size_t idx = (std::size_t(z) * size.y + y) * size.x + x;
+				T val = data[idx];
+				for (auto off : offsets)
+					val = neighbour_fun(data[idx + off], val);
+				data[idx] = mask_fun(val, mask_data[idx]);
+			}
+}
+
+// Forward pass of the cellular image converted to T, cell0-adjacency: the
+// generic kernel against the specialised scalar one (a visitor turns the
+// vectorised row kernel off) and the vectorised one.
+template <typename T, typename convert_f>
+void forward_pass_kernels(const std::string& type,
+                          const i3d::Image3d<i3d::GRAY16>& mask16,
+                          const i3d::Image3d<i3d::GRAY16>& marker16,
+                          bool dilation,
+                          convert_f convert) {
+	namespace fm = i3d::fast_morphology;
+	i3d::Image3d<T> mask, marker, out;
+	mask.MakeRoom(mask16.GetSize());
+	marker.MakeRoom(mask16.GetSize());
+	for (std::size_t i = 0; i < mask.GetImageSize(); ++i) {
+		mask.SetVoxel(i, convert(mask16.GetVoxel(i)));
+		marker.SetVoxel(i, convert(marker16.GetVoxel(i)));
+	}
+	const auto& neigh = fm::neighbour_diffs::forward_3d_0;
+	const std::size_t voxels = mask.GetImageSize();
+
+	out = marker;
+	report("forward pass generic " + type, measure([&] {
+		       generic_forward_pass(
+		           out, mask, {neigh.begin(), neigh.end()}, dilation);
+	       }),
+	       voxels);
+	fm::details::linear_neighbourhood forward(
+	    neigh, i3d::Vector3d<int>(mask.GetSize()));
+	out = marker;
+	report("forward pass unrolled " + type, measure([&] {
+		       fm::details::sweep<true>(
+		           out.GetFirstVoxelAddr(), mask.GetFirstVoxelAddr(),
+		           fm::details::max_fun{}, fm::details::min_fun{}, forward,
+		           [](int, int, int, std::size_t) {});
+	       }),
+	       voxels);
+	if constexpr (!std::is_same_v<T, bool>) {
+		out = marker;
+		report("forward pass unrolled simd " + type, measure([&] {
+			       fm::details::sweep<true>(
+			           out.GetFirstVoxelAddr(), mask.GetFirstVoxelAddr(),
+			           fm::details::max_fun{}, fm::details::min_fun{},
+			           forward);
+		       }),
+		       voxels);
+	}
+}
+} // namespace
+
+int main(int argc, char** argv) {
+	std::size_t size = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 512;
+	if (size < 3) {
+		std::cerr << "./benchmark [SIZE >= 3]\n";
+		return 1;
+	}
+	std::size_t voxels = size * size * size;
+	std::printf("GRAY16 %zu^3\n", size);
+
+	i3d::Image3d<i3d::GRAY16> mask = make_mask(size);
+	i3d::Image3d<i3d::GRAY16> marker = make_marker(mask);
+
+	// ====== single forward pass, cell2-adjacency
+	{
+		i3d::Image3d<i3d::GRAY16> out = marker;
+		report("forward pass GetVoxel",
+		       measure([&] { getvoxel_forward_pass(out, mask); }), voxels);
+		out = marker;
+		auto max = [](i3d::GRAY16 a, i3d::GRAY16 b) { return std::max(a, b); };
+		auto min = [](i3d::GRAY16 a, i3d::GRAY16 b) { return std::min(a, b); };
+		report("forward pass pointer",
+		       measure([&] { pointer_forward_pass(out, mask, max, min); }),
+		       voxels);
+		out = marker;
+		report("forward pass simd", measure([&] {
+			       pointer_forward_pass(
+			           out, mask, i3d::fast_morphology::details::max_fun{},
+			           i3d::fast_morphology::details::min_fun{});
+		       }),
+		       voxels);
+	}
+
+	// ====== specialised kernels against a generic one per voxel type
+	{
+		// read at runtime, so that the generic kernel keeps its choice
+		volatile bool dilation = true;
+		forward_pass_kernels<i3d::GRAY8>(
+		    "GRAY8", mask, marker, dilation,
+		    [](i3d::GRAY16 v) { return i3d::GRAY8(v >> 4); });
+		forward_pass_kernels<i3d::GRAY16>("GRAY16", mask, marker, dilation,
+		                                  [](i3d::GRAY16 v) { return v; });
+		forward_pass_kernels<float>("float", mask, marker, dilation,
+		                            [](i3d::GRAY16 v) { return float(v); });
+		forward_pass_kernels<bool>("bool", mask, marker, dilation,
+		                           [](i3d::GRAY16 v) { return v < 3000; });
+	}
+
+	using i3d::fast_morphology::engine;
+
+	// ====== worst case of the raster passes: spiral corridor, cell0-adjacency
+	{
+		const std::size_t depth = 8;
+		i3d::Image3d<i3d::GRAY16> spiral = make_spiral(size, depth);
+		i3d::Image3d<i3d::GRAY16> seed;
+		seed.MakeRoom(size, size, depth);
+		seed.SetAllVoxels(0);
+		for (std::size_t z = 0; z < depth; ++z)
+			seed.SetVoxel(1, 1, z, 1000);
+		i3d::Image3d<i3d::GRAY16> out;
+		i3d::fast_morphology::options sweeps;
+		sweeps.queue_fraction = 0;
+		for (auto [name, options_] :
+		     {std::pair<const char*, i3d::fast_morphology::options>{
+		          "raster", engine::raster},
+		      {"raster sweeps only", sweeps},
+		      {"downhill", engine::downhill}})
+			report(std::string("spiral ") + name, measure([&] {
+				       i3d::Reconstruction_by_dilation_fast(seed, spiral,
+				                                            out, 0, options_);
+			       }),
+			       size * size * depth);
+	}
+
+	// ====== binary fill-hole, packed raster passes against byte per voxel
+	{
+		i3d::Image3d<bool> binary_mask, binary_marker;
+		binary_mask.MakeRoom(mask.GetSize());
+		for (std::size_t i = 0; i < binary_mask.GetImageSize(); ++i)
+			binary_mask.SetVoxel(i, mask.GetVoxel(i) < 3000);
+		binary_marker.MakeRoom(mask.GetSize());
+		for (std::size_t i = 0; i < binary_marker.GetImageSize(); ++i)
+			binary_marker.SetVoxel(i, marker.GetVoxel(i) != 0 &&
+			                              binary_mask.GetVoxel(i));
+		i3d::Image3d<bool> out;
+		for (auto [name, engine_] : {std::pair{"raster", engine::raster},
+		                             {"hybrid", engine::hybrid}})
+			report(std::string("binary ") + name, measure([&] {
+				       i3d::Reconstruction_by_dilation_fast(
+				           binary_marker, binary_mask, out, 2, engine_);
+			       }),
+			       voxels);
+	}
+
+	// ====== float image, run as is and on 16 bit ranks of its values
+	{
+		i3d::Image3d<float> float_mask, float_marker, out;
+		float_mask.MakeRoom(mask.GetSize());
+		float_marker.MakeRoom(mask.GetSize());
+		for (std::size_t i = 0; i < mask.GetImageSize(); ++i) {
+			float_mask.SetVoxel(i, float(mask.GetVoxel(i)));
+			float_marker.SetVoxel(i, float(marker.GetVoxel(i)));
+		}
+		i3d::fast_morphology::options ranks;
+		ranks.rank_compress = true;
+		for (auto [name, options_] :
+		     {std::pair<const char*, i3d::fast_morphology::options>{
+		          "float raster", engine::raster},
+		      {"float raster ranks", ranks}})
+			report(name, measure([&] {
+				       i3d::Reconstruction_by_dilation_fast(
+				           float_marker, float_mask, out, 2, options_);
+			       }),
+			       voxels);
+	}
+
+	// ====== full reconstruction, cell2-adjacency
+	using i3d::fast_morphology::options;
+	options padded, blocks, sweeps, fused;
+	padded.padded = true;
+	blocks.skip_blocks = true;
+	sweeps.queue_fraction = 0;
+	fused.fused_passes = 4;
+	i3d::Image3d<i3d::GRAY16> out;
+	i3d::fast_morphology::stats stats;
+	for (auto [name, options_] :
+	     {std::pair<const char*, options>{"raster", engine::raster},
+	      {"raster sweeps only", sweeps}, {"raster padded", padded},
+	      {"raster skip blocks", blocks}, {"raster fused passes", fused},
+	      {"hybrid", engine::hybrid},
+	      {"hybrid one thread", options(engine::hybrid, 1)},
+	      {"wavefront", engine::wavefront}, {"tiled", engine::tiled},
+	      {"chaotic", engine::chaotic}, {"checkerboard", engine::checkerboard},
+	      {"union-find", engine::union_find},
+	      {"union-find one thread", options(engine::union_find, 1)},
+	      {"downhill", engine::downhill}}) {
+		options_.stats = &stats;
+		report(std::string("reconstruction ") + name, measure([&] {
+			       i3d::Reconstruction_by_dilation_fast(marker, mask, out, 2,
+			                                            options_);
+		       }),
+		       voxels);
+		if (!stats.passes.empty())
+			std::printf("%-32s %10zu passes, first %zu changed\n", "",
+			            stats.passes.size(), stats.passes.front().changed);
+		if (stats.updates > 0)
+			std::printf("%-32s %10.2f bytes per voxel, %.2f per update\n",
+			            "", double(stats.bytes) / double(voxels),
+			            double(stats.bytes) / double(stats.updates));
+	}
+
+	// ====== arbitrary neighbourhoods: the 6-neighbourhood as an
+	// i3d::Neighbourhood against cell2-adjacency, and one reaching two voxels
+	// in plane as for slices twice as thick as the in-plane spacing
+	{
+		i3d::Neighbourhood six, anisotropic;
+		six.offset = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+		for (int dy = -2; dy <= 2; ++dy)
+			for (int dx = -2; dx <= 2; ++dx)
+				if (dx != 0 || dy != 0)
+					anisotropic.offset.emplace_back(dx, dy, 0);
+		anisotropic.offset.emplace_back(0, 0, 1);
+		for (auto [name, neighbourhood] :
+		     {std::pair{"neighbourhood 6", &six},
+		      {"neighbourhood 5x5 in plane", &anisotropic}})
+			report(name, measure([&] {
+				       i3d::Reconstruction_by_dilation_fast(
+				           marker, mask, out, *neighbourhood);
+			       }),
+			       voxels);
+	}
+
+	// ====== incremental update after painting a 4^3 seed into one cell and
+	// after erasing it again
+	{
+		i3d::Image3d<i3d::GRAY16> edited = marker, result;
+		i3d::Reconstruction_by_dilation_fast(edited, mask, result, 2);
+		const int at = int(size / 2) + 8;
+		const i3d::VOI<i3d::PIXELS> voi(at, at, at, 4, 4, 4);
+		i3d::Image3d<i3d::GRAY16> seed, erased;
+		seed.MakeRoom(voi.size);
+		seed.SetAllVoxels(4000);
+		erased.MakeRoom(voi.size);
+		erased.SetAllVoxels(0);
+		for (auto [name, patch] :
+		     {std::pair{"update paint", &seed}, {"update erase", &erased}})
+			report(name, measure([&] {
+				       i3d::Reconstruction_by_dilation_fast_update(
+				           edited, mask, result, voi, *patch, 2);
+			       }),
+			       voxels);
+	}
+
+	// ====== fill-hole of a time series: a small blob moving inside one cell,
+	// each frame on its own and warm-started from the previous one
+	if (size >= 32) {
+		const std::size_t frames = 8;
+		const std::size_t at = size / 2 - size / 2 % 32 + 12;
+		std::vector<i3d::Image3d<i3d::GRAY16>> series(frames, mask), filled;
+		for (std::size_t t = 0; t < frames; ++t)
+			for (std::size_t z = 0; z < 4; ++z)
+				for (std::size_t y = 0; y < 4; ++y)
+					for (std::size_t x = 0; x < 4; ++x)
+						series[t].SetVoxel(at + 2 * t + x, at + y, at + z,
+						                   2000);
+		report("fillhole frames", measure([&] {
+			       filled.resize(frames);
+			       for (std::size_t t = 0; t < frames; ++t)
+				       i3d::Fillhole_fast(series[t], filled[t], 2);
+		       }),
+		       voxels * frames);
+		report("fillhole series", measure([&] {
+			       i3d::Fillhole_fast_series(series, filled, 2);
+		       }),
+		       voxels * frames);
+	}
+}
@@ -1,18 +1,272 @@
 #pragma once
+#include <atomic>
+#include <cstddef>
 #include <i3d/image3d.h>
+#include <i3d/neighbours.h>
+#include <i3d/se.h>
+#include <vector>
 
 namespace i3d {
+namespace fast_morphology {
+enum class engine {
+	// repeated forward + backward raster passes until nothing changes, on
+	// rows packed to 64 voxels per word for Image3d<bool>
+	raster,
+	// one forward + backward raster pass followed by FIFO propagation, spread
+	// over the threads, idle ones stealing queued voxels from busy ones
+	hybrid,
+	// raster passes with slices dealt round-robin to threads, each thread
+	// trailing the owner of the previous slice by a row
+	wavefront,
+	// tiles reconstructed to local convergence in parallel, repeated for the
+	// tiles whose halo changed
+	tiled,
+	// blocks swept to local convergence by threads claiming dirty ones from a
+	// shared list without barriers, the voxels next to other blocks accessed
+	// atomically; scales where the barriers of the others stall
+	chaotic,
+	// the voxels coloured so that no two neighbours share a colour
+	// (red-black for the 6-neighbourhood) and the colours updated in turn,
+	// every voxel of one colour at once over the tiles near a change; more
+	// iterations than the raster passes, but each one fully parallel
+	checkerboard,
+	// one pass over the component tree of the mask, built by union-find; the
+	// trees of blocks are built by the threads and joined along their faces
+	union_find,
+	// single pass over per grey level lists (downhill filter), 8 and 16 bit
+	// integer images only
+	downhill,
+};
+
+// Convergence statistics of one reconstruction, see options::stats.
+struct pass_stats {
+	bool forward;
+	// voxels changed by the pass
+	std::size_t changed;
+	double seconds;
+	// image data streamed by the pass: marker read and written, mask read
+	std::size_t bytes;
+};
+
+struct stats {
+	// forward + backward pass pairs
+	std::size_t iterations = 0;
+	// raster passes in the order they ran
+	std::vector<pass_stats> passes;
+	// wall time of the whole reconstruction
+	double seconds = 0;
+	// image data streamed and voxels swept by all the passes; bytes per
+	// update is 3 * sizeof(img_t) for plain passes and falls with
+	// options::fused_passes, which streams a tile once for several passes
+	std::size_t bytes = 0;
+	std::size_t updates = 0;
+};
+
+struct options {
+	fast_morphology::engine engine = fast_morphology::engine::raster;
+	// worker threads of the parallel engines and of the propagation of
+	// engine::hybrid, 0 = i3d::GetNumberOfProcessors()
+	std::size_t threads = 0;
+	// edge length of the tiles of engine::tiled, engine::checkerboard and the
+	// fused passes and of the blocks of engine::chaotic and engine::union_find
+	std::size_t tile_size = 64;
+	// engine::raster on a non-binary image: up to this many forward + backward
+	// pass pairs over each tile, grown by a halo as far as they propagate,
+	// before moving to the next, repeated for the tiles near a change, 0 =
+	// passes over the whole image. Cuts the memory traffic of images much
+	// larger than the last level cache, which a grown tile of marker and mask
+	// should fit. Ignores padded and skip_blocks, queue_fraction applies to
+	// the voxels changed by a round over the tiles. A round counts as a pass
+	// of max_passes and as an iteration of the stats, which record the pass
+	// queueing for the FIFO only
+	std::size_t fused_passes = 0;
+	// engine::raster on an internal copy bordered by the neutral element of
+	// the neighbour function, without bound checks
+	bool padded = false;
+	// engine::raster, padded or on a 3d image, also skips the 8x8x8 blocks a
+	// summary of their marker extrema proves settled; pays off when the
+	// changes of a pass are few and scattered along the rows
+	bool skip_blocks = false;
+	// engine::raster on a non-binary image: once a forward pass changes fewer
+	// than this fraction of the voxels, the next backward pass queues the
+	// voxels left to propagate from and FIFO propagation finishes as in
+	// engine::hybrid, 0 = never. Spares the many passes of a thin front
+	// crawling through a maze-like mask
+	double queue_fraction = 0.02;
+	// run on the dense ranks of the values in an 8 bit (16 bit for wider
+	// types) image if marker and mask have at most 256 (65536) distinct
+	// values; costs a counting and two mapping passes
+	bool rank_compress = false;
+	// limits of the raster and hybrid engines, 0 and null for none: at most
+	// max_passes raster passes, max_seconds of wall time, checked between
+	// rows, and stopping as soon as *cancel is set. A stopped reconstruction
+	// leaves a partial result, a lower (upper for erosion) bound of the full
+	// one, and reports that it has not converged
+	std::size_t max_passes = 0;
+	double max_seconds = 0;
+	const std::atomic<bool>* cancel = nullptr;
+	// reset and filled by the reconstruction if set; the passes of the raster
+	// based engines are recorded, the others report the total time only
+	fast_morphology::stats* stats = nullptr;
+
+	options() = default;
+	options(fast_morphology::engine engine_, std::size_t threads_ = 0)
+	    : engine(engine_), threads(threads_) {}
+};
+}
+
+// Return false if stopped by a limit of the options before converging, out
+// then holds the partial result.
+template <typename img_t>
+bool Reconstruction_by_dilation_fast(
+    const i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    i3d::Image3d<img_t>& out,
+    int cell_adjacency = 0,
+    const fast_morphology::options& options_ = {});
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(
+    const i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    i3d::Image3d<img_t>& out,
+    int cell_adjacency = 0,
+    const fast_morphology::options& options_ = {});
+
+// In-place variants, the marker is replaced by the reconstruction.
+template <typename img_t>
+bool Reconstruction_by_dilation_fast(
+    i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    int cell_adjacency = 0,
+    const fast_morphology::options& options_ = {});
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(
+    i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    int cell_adjacency = 0,
+    const fast_morphology::options& options_ = {});
+
+// Variants with an arbitrary neighbourhood or flat structuring element, for
+// anisotropic connectivities or ones reaching further than the adjacent
+// voxels. Offsets are taken together with their reflections, so that the
+// adjacency is symmetric, and split into the causal halves of the raster
+// passes; at most 128 neighbours once reflected. engine::raster of
+// Image3d<bool> runs unpacked unless the neighbourhood reaches at most one
+// voxel along the rows and holds both in-row neighbours.
+template <typename img_t>
+bool Reconstruction_by_dilation_fast(
+    const i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    i3d::Image3d<img_t>& out,
+    const i3d::Neighbourhood& neighbourhood,
+    const fast_morphology::options& options_ = {});
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(
+    const i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    i3d::Image3d<img_t>& out,
+    const i3d::Neighbourhood& neighbourhood,
+    const fast_morphology::options& options_ = {});
+
 template <typename img_t>
-void Reconstruction_by_dilation_fast(const i3d::Image3d<img_t>& marker,
-                                     const i3d::Image3d<img_t>& mask,
-                                     i3d::Image3d<img_t>& out,
-                                     int cell_adjacency = 0 );
+bool Reconstruction_by_dilation_fast(
+    i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    const i3d::Neighbourhood& neighbourhood,
+    const fast_morphology::options& options_ = {});
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(
+    i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    const i3d::Neighbourhood& neighbourhood,
+    const fast_morphology::options& options_ = {});
+
+template <typename img_t>
+bool Reconstruction_by_dilation_fast(
+    const i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    i3d::Image3d<img_t>& out,
+    const se::StructuringElement& se,
+    const fast_morphology::options& options_ = {});
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(
+    const i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    i3d::Image3d<img_t>& out,
+    const se::StructuringElement& se,
+    const fast_morphology::options& options_ = {});
+
+template <typename img_t>
+bool Reconstruction_by_dilation_fast(
+    i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    const se::StructuringElement& se,
+    const fast_morphology::options& options_ = {});
+
+template <typename img_t>
+bool Reconstruction_by_erosion_fast(
+    i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    const se::StructuringElement& se,
+    const fast_morphology::options& options_ = {});
+
+// Incremental variants for interactive editing. out holds the
+// reconstruction of marker and mask as they were before an edit inside voi:
+// marker_patch (of voi.size) is written to the marker, the mask may have
+// been changed inside voi beforehand. out is updated by propagating from the
+// edited voxels only, whatever depended on a lowered value is recomputed
+// locally. Of the options only stats is used, the limits are ignored.
+template <typename img_t>
+void Reconstruction_by_dilation_fast_update(
+    i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    i3d::Image3d<img_t>& out,
+    const i3d::VOI<i3d::PIXELS>& voi,
+    const i3d::Image3d<img_t>& marker_patch,
+    int cell_adjacency = 0,
+    const fast_morphology::options& options_ = {});
+
+template <typename img_t>
+void Reconstruction_by_erosion_fast_update(
+    i3d::Image3d<img_t>& marker,
+    const i3d::Image3d<img_t>& mask,
+    i3d::Image3d<img_t>& out,
+    const i3d::VOI<i3d::PIXELS>& voi,
+    const i3d::Image3d<img_t>& marker_patch,
+    int cell_adjacency = 0,
+    const fast_morphology::options& options_ = {});
+
+// Holes filling by reconstruction by erosion as i3d::Fillhole, the marker is
+// built directly in out. Returns false if stopped by a limit of the options.
+template <typename img_t>
+bool Fillhole_fast(const i3d::Image3d<img_t>& in,
+                   i3d::Image3d<img_t>& out,
+                   int cell_adjacency = 0,
+                   const fast_morphology::options& options_ = {});
+
+// Fillhole_fast of every frame of a time series of images of one size.
+// load(t, frame) fills frame t, store(t, result) receives its result; frame
+// t + 1 is loaded by another thread while frame t is computed. A frame
+// starts from the result of the previous one and propagates from the voxels
+// that changed only, unless too many of them did. stats describes the last
+// frame, the limits are ignored.
+template <typename img_t, typename load_f, typename store_f>
+void Fillhole_fast_series(std::size_t frames,
+                          load_f load,
+                          store_f store,
+                          int cell_adjacency = 0,
+                          const fast_morphology::options& options_ = {});
 
 template <typename img_t>
-void Reconstruction_by_erosion_fast(const i3d::Image3d<img_t>& marker,
-                                    const i3d::Image3d<img_t>& mask,
-                                    i3d::Image3d<img_t>& out,
-                                    int cell_adjacency = 0);
+void Fillhole_fast_series(const std::vector<i3d::Image3d<img_t>>& in,
+                          std::vector<i3d::Image3d<img_t>>& out,
+                          int cell_adjacency = 0,
+                          const fast_morphology::options& options_ = {});
 }
 
 #include "_fast_morphology_impl.hpp"
\ No newline at end of file
@@ -26,7 +26,7 @@ int main(int argc, char** argv) {
 				marker.SetVoxel(x, y, z, min);
 	}
 
-	i3d::Reconstruction_by_dilation_fast(marker, img, marker, 2);
+	i3d::Reconstruction_by_dilation_fast(marker, img, 2);
 
 	marker.SaveImage(argv[2]);
 }
\ No newline at end of file
@@ -0,0 +1,421 @@
+#include <cstdio>
+#include <i3d/image3d.h>
+#include <i3d/neighbours.h>
+#include <limits>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "fast_morphology.hpp"
+
+namespace {
+namespace fm = i3d::fast_morphology;
+
+int failures = 0;
+
+template <typename img_t>
+std::string type_name() {
+	if constexpr (std::is_same_v<img_t, bool>)
+		return "bool";
+	else if constexpr (std::is_same_v<img_t, i3d::GRAY8>)
+		return "GRAY8";
+	else if constexpr (std::is_same_v<img_t, i3d::GRAY16>)
+		return "GRAY16";
+	else
+		return "float";
+}
+
+template <typename img_t>
+img_t value(unsigned v, unsigned levels) {
+	if constexpr (std::is_same_v<img_t, bool>)
+		return v % 2 != 0;
+	else
+		return img_t(v % levels);
+}
+
+template <typename img_t>
+unsigned levels() {
+	if constexpr (std::is_same_v<img_t, bool>)
+		return 2;
+	else if constexpr (std::is_same_v<img_t, i3d::GRAY8>)
+		return 200;
+	else
+		return 3000;
+}
+
+// Reports the first voxel where out differs from ref, true if none.
+template <typename img_t>
+bool compare(const i3d::Image3d<img_t>& out,
+             const i3d::Image3d<img_t>& ref,
+             const std::string& what) {
+	if (out.GetSize() != ref.GetSize()) {
+		std::printf("FAIL %s %s: size differs\n", what.c_str(),
+		            type_name<img_t>().c_str());
+		++failures;
+		return false;
+	}
+	for (std::size_t i = 0; i < ref.GetImageSize(); ++i)
+		if (out.GetVoxel(i) != ref.GetVoxel(i)) {
+			std::printf("FAIL %s %s: voxel %zu is %g, expected %g\n",
+			            what.c_str(), type_name<img_t>().c_str(), i,
+			            double(out.GetVoxel(i)), double(ref.GetVoxel(i)));
+			++failures;
+			return false;
+		}
+	return true;
+}
+
+// Offsets of a cell adjacency: at most as many non-zero coordinates as the
+// image has dimensions minus the adjacency.
+std::vector<i3d::Vector3d<int>>
+adjacency_offsets(const i3d::Vector3d<int>& size, int cell_adjacency) {
+	int dims = (size.x > 1) + (size.y > 1) + (size.z > 1);
+	std::vector<i3d::Vector3d<int>> offsets;
+	for (int dz = -(size.z > 1); dz <= (size.z > 1); ++dz)
+		for (int dy = -(size.y > 1); dy <= (size.y > 1); ++dy)
+			for (int dx = -(size.x > 1); dx <= (size.x > 1); ++dx) {
+				int nonzero = (dx != 0) + (dy != 0) + (dz != 0);
+				if (nonzero > 0 && nonzero <= dims - cell_adjacency)
+					offsets.emplace_back(dx, dy, dz);
+			}
+	return offsets;
+}
+
+// Brute-force reconstruction: the marker bounded by the mask, then every
+// voxel replaced by the extremum over itself and its neighbours, bounded by
+// the mask, until nothing changes. offsets are taken together with their
+// reflections.
+template <typename img_t>
+i3d::Image3d<img_t> reference(const i3d::Image3d<img_t>& marker,
+                              const i3d::Image3d<img_t>& mask,
+                              const std::vector<i3d::Vector3d<int>>& offsets,
+                              bool dilation) {
+	auto neighbour_fun = [&](img_t a, img_t b) {
+		return dilation ? std::max(a, b) : std::min(a, b);
+	};
+	auto mask_fun = [&](img_t a, img_t b) {
+		return dilation ? std::min(a, b) : std::max(a, b);
+	};
+	i3d::Image3d<img_t> out = marker;
+	for (std::size_t i = 0; i < out.GetImageSize(); ++i)
+		out.SetVoxel(i, mask_fun(out.GetVoxel(i), mask.GetVoxel(i)));
+	i3d::Vector3d<int> size = out.GetSize();
+	bool change = true;
+	while (change) {
+		change = false;
+		for (int z = 0; z < size.z; ++z)
+			for (int y = 0; y < size.y; ++y)
+				for (int x = 0; x < size.x; ++x) {
+					img_t val = out.GetVoxel(x, y, z);
+					for (const auto& d : offsets)
+						for (int sign : {-1, 1}) {
+							int nx = x + sign * d.x, ny = y + sign * d.y,
+							    nz = z + sign * d.z;
+							if (0 <= nx && nx < size.x && 0 <= ny &&
+							    ny < size.y && 0 <= nz && nz < size.z)
+								val = neighbour_fun(out.GetVoxel(nx, ny, nz),
+								                    val);
+						}
+					val = mask_fun(val, mask.GetVoxel(x, y, z));
+					if (val != out.GetVoxel(x, y, z)) {
+						out.SetVoxel(x, y, z, val);
+						change = true;
+					}
+				}
+	}
+	return out;
+}
+
+// Random mask, marker seeded at a few voxels.
+template <typename img_t>
+void make_random(const i3d::Vector3d<int>& size,
+                 unsigned seed,
+                 i3d::Image3d<img_t>& marker,
+                 i3d::Image3d<img_t>& mask) {
+	std::mt19937 rng(seed);
+	mask.MakeRoom(size.x, size.y, size.z);
+	marker.MakeRoom(size.x, size.y, size.z);
+	for (std::size_t i = 0; i < mask.GetImageSize(); ++i) {
+		mask.SetVoxel(i, value<img_t>(rng(), levels<img_t>()));
+		marker.SetVoxel(i, rng() % 50 == 0
+		                       ? value<img_t>(rng(), levels<img_t>())
+		                       : value<img_t>(0, levels<img_t>()));
+	}
+}
+
+// Square spiral corridor of random values between walls of 0, the same in
+// every slice, the marker seeded at its outer end: a front winding through
+// the whole image, many raster passes.
+template <typename img_t>
+void make_maze(const i3d::Vector3d<int>& size,
+               unsigned seed,
+               i3d::Image3d<img_t>& marker,
+               i3d::Image3d<img_t>& mask) {
+	std::mt19937 rng(seed);
+	mask.MakeRoom(size.x, size.y, size.z);
+	marker.MakeRoom(size.x, size.y, size.z);
+	mask.SetAllVoxels(value<img_t>(0, levels<img_t>()));
+	marker.SetAllVoxels(value<img_t>(0, levels<img_t>()));
+	std::vector<bool> corridor(std::size_t(size.x) * size.y, false);
+	const int dirs[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+	auto inside = [&](int x, int y) {
+		return 1 <= x && x < size.x - 1 && 1 <= y && y < size.y - 1;
+	};
+	auto dug = [&](int x, int y) {
+		return corridor[std::size_t(y) * size.x + x];
+	};
+	auto can_step = [&](int x, int y, int d) {
+		int nx = x + dirs[d][0], ny = y + dirs[d][1];
+		return inside(nx, ny) && !dug(nx, ny) &&
+		       !(inside(nx + dirs[d][0], ny + dirs[d][1]) &&
+		         dug(nx + dirs[d][0], ny + dirs[d][1]));
+	};
+	int x = 1, y = 1, d = 0;
+	while (true) {
+		corridor[std::size_t(y) * size.x + x] = true;
+		for (int z = 0; z < size.z; ++z)
+			mask.SetVoxel(x, y, z,
+			              value<img_t>(1 + rng() % (levels<img_t>() - 1),
+			                           levels<img_t>()));
+		if (!can_step(x, y, d)) {
+			d = (d + 1) % 4;
+			if (!can_step(x, y, d))
+				break;
+		}
+		x += dirs[d][0];
+		y += dirs[d][1];
+	}
+	for (int z = 0; z < size.z; ++z)
+		marker.SetVoxel(1, 1, z, mask.GetVoxel(1, 1, z));
+}
+
+// Every engine with the options it reads, for images of type img_t.
+template <typename img_t>
+std::vector<std::pair<std::string, fm::options>> all_options() {
+	std::vector<std::pair<std::string, fm::options>> all;
+	auto add = [&](const std::string& name, fm::options options_) {
+		options_.tile_size = 5;
+		all.emplace_back(name, options_);
+	};
+	fm::options sweeps, padded, blocks, ranks, fused, fused_sweeps;
+	sweeps.queue_fraction = 0;
+	padded.padded = true;
+	blocks.skip_blocks = true;
+	ranks.rank_compress = true;
+	fused.fused_passes = 2;
+	fused_sweeps.fused_passes = 3;
+	fused_sweeps.queue_fraction = 0;
+	add("raster", fm::engine::raster);
+	add("raster sweeps only", sweeps);
+	add("raster padded", padded);
+	add("raster skip blocks", blocks);
+	add("raster ranks", ranks);
+	add("raster fused passes", fused);
+	add("raster fused sweeps only", fused_sweeps);
+	for (std::size_t threads : {1, 3}) {
+		std::string suffix = " threads " + std::to_string(threads);
+		add("hybrid" + suffix, fm::options(fm::engine::hybrid, threads));
+		add("wavefront" + suffix, fm::options(fm::engine::wavefront, threads));
+		add("tiled" + suffix, fm::options(fm::engine::tiled, threads));
+		add("chaotic" + suffix, fm::options(fm::engine::chaotic, threads));
+		add("checkerboard" + suffix,
+		    fm::options(fm::engine::checkerboard, threads));
+		add("union-find" + suffix,
+		    fm::options(fm::engine::union_find, threads));
+	}
+	if constexpr (std::is_integral_v<img_t> && !std::is_same_v<img_t, bool> &&
+	              sizeof(img_t) <= 2)
+		add("downhill", fm::engine::downhill);
+	return all;
+}
+
+// Every engine against the brute-force reference, by dilation and erosion
+// and for every cell adjacency valid for the size.
+template <typename img_t>
+void check_engines(const i3d::Image3d<img_t>& marker,
+                   const i3d::Image3d<img_t>& mask,
+                   const std::string& input) {
+	i3d::Vector3d<int> size = marker.GetSize();
+	int dims = (size.x > 1) + (size.y > 1) + (size.z > 1);
+	for (int adjacency = 0; adjacency < dims; ++adjacency)
+		for (bool dilation : {true, false}) {
+			i3d::Image3d<img_t> ref = reference(
+			    marker, mask, adjacency_offsets(size, adjacency), dilation);
+			for (const auto& [name, options_] : all_options<img_t>()) {
+				i3d::Image3d<img_t> out;
+				if (dilation)
+					i3d::Reconstruction_by_dilation_fast(marker, mask, out,
+					                                     adjacency, options_);
+				else
+					i3d::Reconstruction_by_erosion_fast(marker, mask, out,
+					                                    adjacency, options_);
+				compare(out, ref,
+				        input + (dilation ? " dilation " : " erosion ") +
+				            "adjacency " + std::to_string(adjacency) + " " +
+				            name);
+			}
+		}
+}
+
+// An anisotropic neighbourhood reaching two voxels, given by one offset of
+// every pair of reflections.
+template <typename img_t>
+void check_neighbourhood(const i3d::Image3d<img_t>& marker,
+                         const i3d::Image3d<img_t>& mask,
+                         const std::string& input) {
+	i3d::Neighbourhood neighbourhood;
+	neighbourhood.offset = {{2, 0, 0}, {0, 1, 0}, {1, -2, 1}, {0, 0, 2}};
+	std::vector<i3d::Vector3d<int>> offsets(neighbourhood.offset.begin(),
+	                                        neighbourhood.offset.end());
+	for (bool dilation : {true, false}) {
+		i3d::Image3d<img_t> ref = reference(marker, mask, offsets, dilation);
+		for (const auto& [name, options_] : all_options<img_t>()) {
+			i3d::Image3d<img_t> out;
+			if (dilation)
+				i3d::Reconstruction_by_dilation_fast(marker, mask, out,
+				                                     neighbourhood, options_);
+			else
+				i3d::Reconstruction_by_erosion_fast(marker, mask, out,
+				                                    neighbourhood, options_);
+			compare(out, ref,
+			        input + (dilation ? " dilation " : " erosion ") +
+			            "neighbourhood " + name);
+		}
+	}
+}
+
+// The incremental update after a patch of the marker and a change of the
+// mask inside the same volume, against the reconstruction from scratch.
+template <typename img_t>
+void check_update(const i3d::Image3d<img_t>& marker_,
+                  const i3d::Image3d<img_t>& mask_,
+                  unsigned seed,
+                  const std::string& input) {
+	std::mt19937 rng(seed);
+	i3d::Vector3d<int> size = marker_.GetSize();
+	i3d::Vector3d<int> offset(size.x / 4, size.y / 4, size.z / 4);
+	i3d::Vector3d<int> extent(std::max(size.x / 3, 1), std::max(size.y / 3, 1),
+	                          std::max(size.z / 3, 1));
+	i3d::VOI<i3d::PIXELS> voi(offset, extent);
+	for (bool dilation : {true, false}) {
+		i3d::Image3d<img_t> marker = marker_, mask = mask_, out;
+		if (dilation)
+			i3d::Reconstruction_by_dilation_fast(marker, mask, out);
+		else
+			i3d::Reconstruction_by_erosion_fast(marker, mask, out);
+
+		i3d::Image3d<img_t> patch;
+		patch.MakeRoom(extent.x, extent.y, extent.z);
+		for (std::size_t i = 0; i < patch.GetImageSize(); ++i)
+			patch.SetVoxel(i, value<img_t>(rng(), levels<img_t>()));
+		for (int z = 0; z < extent.z; ++z)
+			for (int y = 0; y < extent.y; ++y)
+				for (int x = 0; x < extent.x; ++x)
+					if (rng() % 4 == 0)
+						mask.SetVoxel(offset.x + x, offset.y + y,
+						              offset.z + z,
+						              value<img_t>(rng(), levels<img_t>()));
+		if (dilation)
+			i3d::Reconstruction_by_dilation_fast_update(marker, mask, out, voi,
+			                                            patch);
+		else
+			i3d::Reconstruction_by_erosion_fast_update(marker, mask, out, voi,
+			                                           patch);
+
+		i3d::Image3d<img_t> edited = marker_;
+		for (int z = 0; z < extent.z; ++z)
+			for (int y = 0; y < extent.y; ++y)
+				for (int x = 0; x < extent.x; ++x)
+					edited.SetVoxel(offset.x + x, offset.y + y, offset.z + z,
+					                patch.GetVoxel(x, y, z));
+		compare(marker, edited,
+		        input + (dilation ? " dilation" : " erosion") +
+		            " update marker");
+		compare(out,
+		        reference(edited, mask, adjacency_offsets(size, 0), dilation),
+		        input + (dilation ? " dilation" : " erosion") + " update");
+	}
+}
+
+// Fillhole_fast against the reference and Fillhole_fast_series against
+// Fillhole_fast of every frame, the frames differing a little.
+template <typename img_t>
+void check_fillhole(const i3d::Image3d<img_t>& in,
+                    unsigned seed,
+                    const std::string& input) {
+	std::mt19937 rng(seed);
+	i3d::Vector3d<int> size = in.GetSize();
+	i3d::Image3d<img_t> marker = in;
+	for (int z = 0; z < size.z; ++z)
+		for (int y = 0; y < size.y; ++y)
+			for (int x = 0; x < size.x; ++x) {
+				auto inner = [](int c, int extent) {
+					return extent == 1 || (0 < c && c < extent - 1);
+				};
+				if (inner(x, size.x) && inner(y, size.y) && inner(z, size.z))
+					marker.SetVoxel(x, y, z, std::numeric_limits<img_t>::max());
+			}
+	i3d::Image3d<img_t> out;
+	i3d::Fillhole_fast(in, out);
+	compare(out, reference(marker, in, adjacency_offsets(size, 0), false),
+	        input + " fillhole");
+
+	std::vector<i3d::Image3d<img_t>> frames{in}, results;
+	for (int t = 1; t < 4; ++t) {
+		frames.push_back(frames.back());
+		for (std::size_t i = 0; i < in.GetImageSize(); ++i)
+			if (rng() % (t == 3 ? 2 : 64) == 0)
+				frames.back().SetVoxel(i, value<img_t>(rng(), levels<img_t>()));
+	}
+	i3d::Fillhole_fast_series(frames, results);
+	for (std::size_t t = 0; t < frames.size(); ++t) {
+		i3d::Fillhole_fast(frames[t], out);
+		compare(results[t], out,
+		        input + " fillhole series frame " + std::to_string(t));
+	}
+}
+
+template <typename img_t>
+void check_type() {
+	const i3d::Vector3d<int> sizes[] = {
+	    {23, 19, 13}, {41, 37, 1}, {57, 1, 1}, {70, 6, 3}};
+	for (unsigned seed = 0; seed < 2; ++seed)
+		for (const auto& size : sizes) {
+			std::string input = "random " + std::to_string(size.x) + "x" +
+			                    std::to_string(size.y) + "x" +
+			                    std::to_string(size.z) + " seed " +
+			                    std::to_string(seed);
+			i3d::Image3d<img_t> marker, mask;
+			make_random(size, seed, marker, mask);
+			check_engines(marker, mask, input);
+			if (size.z > 1)
+				check_neighbourhood(marker, mask, input);
+			check_update(marker, mask, seed, input);
+			check_fillhole(mask, seed, input);
+		}
+	for (const i3d::Vector3d<int>& size :
+	     {i3d::Vector3d<int>(25, 25, 3), i3d::Vector3d<int>(31, 27, 1)}) {
+		std::string input = "maze " + std::to_string(size.x) + "x" +
+		                    std::to_string(size.y) + "x" +
+		                    std::to_string(size.z);
+		i3d::Image3d<img_t> marker, mask;
+		make_maze(size, 7, marker, mask);
+		check_engines(marker, mask, input);
+		check_update(marker, mask, 7, input);
+		check_fillhole(mask, 7, input);
+	}
+}
+} // namespace
+
+int main() {
+	check_type<i3d::GRAY8>();
+	check_type<i3d::GRAY16>();
+	check_type<float>();
+	check_type<bool>();
+	if (failures != 0) {
+		std::printf("%d checks failed\n", failures);
+		return 1;
+	}
+	std::printf("all checks passed\n");
+	return 0;
+}